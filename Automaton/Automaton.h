@@ -12,12 +12,288 @@
 #include "st_tree.h"
 #include <string>
 #include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include "cd00.h"
 
 using std::list;
 using std::string;
+using std::vector;
 using st_tree::tree;
 
-template <class ListContainer = list<string>, class TreeContainer = tree<string>> class Automaton
+// Layouts of states. A transition is a single word, laid out as by the
+// bit-fields of transition in cd00.h: the label sits in bits 23-30 and the
+// terminal flag in bit 31 in every layout; the low bits differ. Each layout
+// finds transitions of a state in its own way.
+
+// States stored as sorted runs of transitions, the last one marked.
+struct FlatLayout
+{
+    static const unsigned tag = LAYOUT_FLAT;
+
+    static unsigned dest(unsigned t) { return (t >> 1) & 0x3fffff; }
+    static unsigned attr(unsigned t) { return (t >> 23) & 0xff; }
+    static bool term(unsigned t) { return (t >> 31) != 0; }
+    static bool last(unsigned t) { return (t & 1) != 0; }
+
+    // Are the transitions of the state at pos in label order?
+    static bool sorted(const unsigned *, unsigned)
+    {
+        return true;
+    }
+
+    // First transition (in label order) of the state at pos.
+    static unsigned firstTrans(const unsigned *, unsigned pos)
+    {
+        return pos;
+    }
+
+    // Transition following t (in label order) in the state at pos, or 0;
+    // sorted is what sorted() tells about the state.
+    static unsigned nextTrans(const unsigned *a, unsigned, unsigned t, bool)
+    {
+        return last(a[t]) ? 0 : t + 1;
+    }
+
+    // Last transition (in label order) of the state at pos.
+    static unsigned lastTrans(const unsigned *a, unsigned pos)
+    {
+        while (!last(a[pos]))
+            pos++;
+        return pos;
+    }
+
+    // First transition of the state at pos labelled with a symbol >= w, or 0.
+    static unsigned lowerTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        for (;; pos++)
+        {
+            if (attr(a[pos]) >= w)
+                return pos;
+            if (last(a[pos]))
+                return 0;
+        }
+    }
+
+    // Last transition of the state at pos labelled with a symbol < w, or 0.
+    static unsigned lessTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        unsigned best = 0;
+
+        for (; attr(a[pos]) < w; pos++)
+        {
+            best = pos;
+            if (last(a[pos]))
+                break;
+        }
+        return best;
+    }
+};
+
+// Flat states, of which the reorganized ones (that include others) are not
+// sorted, so every search scans the whole state.
+struct InclusionLayout : FlatLayout
+{
+    static const unsigned tag = LAYOUT_INCLUSION;
+
+    static bool sorted(const unsigned *a, unsigned pos)
+    {
+        for (; !last(a[pos]); pos++)
+            if (attr(a[pos + 1]) < attr(a[pos]))
+                return false;
+        return true;
+    }
+
+    static unsigned firstTrans(const unsigned *a, unsigned pos)
+    {
+        unsigned best = pos;
+
+        while (!last(a[pos++]))
+            if (attr(a[pos]) < attr(a[best]))
+                best = pos;
+        return best;
+    }
+
+    static unsigned nextTrans(const unsigned *a, unsigned pos, unsigned t, bool sorted)
+    {
+        if (sorted)
+            return last(a[t]) ? 0 : t + 1;
+        return lowerTrans(a, pos, attr(a[t]) + 1);
+    }
+
+    static unsigned lastTrans(const unsigned *a, unsigned pos)
+    {
+        unsigned best = pos;
+
+        while (!last(a[pos++]))
+            if (attr(a[pos]) > attr(a[best]))
+                best = pos;
+        return best;
+    }
+
+    static unsigned lowerTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        unsigned best = 0;
+
+        do
+        {
+            if (attr(a[pos]) >= w && (!best || attr(a[pos]) < attr(a[best])))
+                best = pos;
+        } while (!last(a[pos++]));
+        return best;
+    }
+
+    static unsigned lessTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        unsigned best = 0;
+
+        do
+        {
+            if (attr(a[pos]) < w && (!best || attr(a[pos]) > attr(a[best])))
+                best = pos;
+        } while (!last(a[pos++]));
+        return best;
+    }
+};
+
+// States stored as complete binary trees in Eytzinger order: the children
+// of node k (counted from 1) are 2k and 2k+1; llast and rlast mark nodes
+// without a left or right subtree.
+struct TreeLayout
+{
+    static const unsigned tag = LAYOUT_TREE;
+
+    static unsigned dest(unsigned t) { return (t >> 2) & 0x1fffff; }
+    static unsigned attr(unsigned t) { return (t >> 23) & 0xff; }
+    static bool term(unsigned t) { return (t >> 31) != 0; }
+    static bool llast(unsigned t) { return (t & 1) != 0; }
+    static bool rlast(unsigned t) { return (t & 2) != 0; }
+
+    static bool sorted(const unsigned *, unsigned)
+    {
+        return true;
+    }
+
+    static unsigned firstTrans(const unsigned *a, unsigned pos)
+    {
+        unsigned k = 1;
+
+        while (!llast(a[pos + k - 1]))
+            k = k + k;
+        return pos + k - 1;
+    }
+
+    static unsigned nextTrans(const unsigned *a, unsigned pos, unsigned t, bool)
+    {
+        unsigned k = t - pos + 1;
+
+        if (!rlast(a[t]))
+        {
+            // leftmost node of the right subtree
+            k = k + k + 1;
+            while (!llast(a[pos + k - 1]))
+                k = k + k;
+            return pos + k - 1;
+        }
+        // go up while coming from the right
+        while (k > 1 && (k & 1))
+            k >>= 1;
+        return k > 1 ? pos + (k >> 1) - 1 : 0;
+    }
+
+    static unsigned lastTrans(const unsigned *a, unsigned pos)
+    {
+        unsigned k = 1;
+
+        while (!rlast(a[pos + k - 1]))
+            k = k + k + 1;
+        return pos + k - 1;
+    }
+
+    static unsigned lowerTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        unsigned k = 1, best = 0;
+
+        while (true)
+        {
+            unsigned e = a[pos + k - 1];
+            if (attr(e) == w)
+                return pos + k - 1;
+            if (attr(e) > w)
+            {
+                best = pos + k - 1;
+                if (llast(e))
+                    return best;
+                k = k + k;
+            }
+            else
+            {
+                if (rlast(e))
+                    return best;
+                k = k + k + 1;
+            }
+        }
+    }
+
+    static unsigned lessTrans(const unsigned *a, unsigned pos, unsigned w)
+    {
+        unsigned k = 1, best = 0;
+
+        while (true)
+        {
+            unsigned e = a[pos + k - 1];
+            if (attr(e) < w)
+            {
+                best = pos + k - 1;
+                if (rlast(e))
+                    return best;
+                k = k + k + 1;
+            }
+            else
+            {
+                if (llast(e))
+                    return best;
+                k = k + k;
+            }
+        }
+    }
+};
+
+// The layout cd00.c was built with.
+#if defined USE_TREE
+typedef TreeLayout DefaultLayout;
+#elif defined USE_INCLUSION
+typedef InclusionLayout DefaultLayout;
+#else
+typedef FlatLayout DefaultLayout;
+#endif
+
+// What an automaton of any layout can do; see loadAutomaton().
+class AutomatonInterface
+{
+public:
+    virtual ~AutomatonInterface()
+    { }
+
+    virtual void load(const string &fileName) = 0;
+    virtual bool contains(const string &word) const = 0;
+#ifdef USE_VALUES
+    virtual bool lookup(const string &word, unsigned &value) const = 0;
+#endif
+    virtual bool successor(const string &key, string &word) const = 0;
+    virtual bool predecessor(const string &key, string &word) const = 0;
+    // Call visit for each word in [lo, hi) in order; an empty hi has no limit.
+    virtual void forEach(const string &lo, const string &hi,
+                         const std::function<void(const string &)> &visit) const = 0;
+};
+
+template <class ListContainer = list<string>, class TreeContainer = tree<string>, class Layout = DefaultLayout>
+class Automaton : public AutomatonInterface
 {
     static_assert(std::is_base_of<list<string>, ListContainer>::value, "ListContainer must inherit from list<string>");
     static_assert(std::is_base_of<tree<string>, TreeContainer>::value, "TreeContainer must inherit from tree<string>");
@@ -26,10 +302,657 @@ private:
     ListContainer listContainer;
     TreeContainer treeContainer;
 
+    vector<unsigned> automat;       // the automaton, as written by cd00.c
+    unsigned startState;            // position of the start state
+#ifdef USE_VALUES
+    vector<unsigned> values;        // output of each transition
+#endif
+#ifdef USE_UTF8
+    vector<unsigned> alphabet;      // code point of each symbol
+#endif
+    vector<unsigned> jump;          // transition reached by the first symbols
+    unsigned jumpDepth;             // their number, 0 without a jump table
+    unsigned jumpRadix;             // symbols at each level of the table
+#ifdef USE_VALUES
+    vector<unsigned> jumpValues;    // sum of outputs on the way
+#endif
+    vector<unsigned> bloom;         // filter of the words, or empty
+    unsigned bloomProbes;           // bits set for each word
+
+    static const size_t noJump = size_t(-1);
+
+    unsigned dest(unsigned t) const { return Layout::dest(automat[t]); }
+    unsigned attr(unsigned t) const { return Layout::attr(automat[t]); }
+    bool term(unsigned t) const { return Layout::term(automat[t]); }
+
+    bool sorted(unsigned pos) const
+    {
+        return Layout::sorted(automat.data(), pos);
+    }
+
+    unsigned firstTrans(unsigned pos) const
+    {
+        return Layout::firstTrans(automat.data(), pos);
+    }
+
+    unsigned nextTrans(unsigned pos, unsigned t, bool sorted) const
+    {
+        return Layout::nextTrans(automat.data(), pos, t, sorted);
+    }
+
+    unsigned lowerTrans(unsigned pos, unsigned w) const
+    {
+        return Layout::lowerTrans(automat.data(), pos, w);
+    }
+
+    unsigned lastTrans(unsigned pos) const
+    {
+        return Layout::lastTrans(automat.data(), pos);
+    }
+
+    unsigned lessTrans(unsigned pos, unsigned w) const
+    {
+        return Layout::lessTrans(automat.data(), pos, w);
+    }
+
+    // Transition of the state at pos labelled with w, or 0.
+    unsigned findTrans(unsigned pos, unsigned w) const
+    {
+        unsigned t = lowerTrans(pos, w);
+        return t && attr(t) == w ? t : 0;
+    }
+
+    // Entry of the jump table for the first jumpDepth symbols of word, with i
+    // moved past them; noJump if there is no table or the word is shorter.
+    // A character missing from the alphabet gives entry 0, which is empty.
+    size_t jumpIndex(const string &word, size_t &i) const
+    {
+        size_t index = 0, j = i;
+        bool exact;
+
+        if (jumpDepth == 0)
+            return noJump;
+        for (unsigned d = 0; d < jumpDepth; d++)
+        {
+            if (j == word.size())
+                return noJump;
+            unsigned w = keySymbol(word, j, exact);
+            if (!exact || w >= jumpRadix)
+                return 0;
+            index = index * jumpRadix + w;
+        }
+        i = j;
+        return index;
+    }
+
+    // Can word be in the automaton, as far as the filter tells? The hash
+    // and the probes are those of bloom_hash and bloom_probe in cd00.c.
+    bool mayContain(const string &word) const
+    {
+        unsigned h = BLOOM_BASIS;
+
+        for (size_t i = 0; i < word.size(); i++)
+            h = (h ^ (unsigned char) word[i]) * BLOOM_PRIME;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+
+        const unsigned *block = bloom.data() + h % (bloom.size() / BLOOM_BLOCK) * BLOOM_BLOCK;
+        unsigned g = h * 0x9e3779b9u, bit = g >> 23, step = (g >> 14 & 511) | 1;
+        for (unsigned i = 0; i < bloomProbes; i++, bit = (bit + step) & 511)
+            if (!(block[bit >> 5] & 1u << (bit & 31)))
+                return false;
+        return true;
+    }
+
+    // Append the text of a symbol to a word.
+    void appendSymbol(string &word, unsigned symbol) const
+    {
+#ifdef USE_UTF8
+        unsigned c = alphabet[symbol];
+
+        if (c < 0x80)
+            word += char(c);
+        else if (c < 0x800)
+        {
+            word += char(0xc0 | (c >> 6));
+            word += char(0x80 | (c & 0x3f));
+        }
+        else if (c < 0x10000)
+        {
+            word += char(0xe0 | (c >> 12));
+            word += char(0x80 | ((c >> 6) & 0x3f));
+            word += char(0x80 | (c & 0x3f));
+        }
+        else
+        {
+            word += char(0xf0 | (c >> 18));
+            word += char(0x80 | ((c >> 12) & 0x3f));
+            word += char(0x80 | ((c >> 6) & 0x3f));
+            word += char(0x80 | (c & 0x3f));
+        }
+#else
+        word += char(symbol);
+#endif
+    }
+
+    // Decode the next symbol of a key at position i. If the character is not
+    // in the alphabet, return the first symbol that sorts after it and clear
+    // exact.
+    unsigned keySymbol(const string &key, size_t &i, bool &exact) const
+    {
+#ifdef USE_UTF8
+        unsigned c = (unsigned char) key[i++];
+        int n = c < 0x80 ? 0 : c < 0xc2 ? -1 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf5 ? 3 : 4;
+
+        exact = true;
+        if (n < 0)
+        {
+            exact = false;              // sorts before any multi-byte character
+            c = 0x80;
+        }
+        else if (n == 4)
+            c = MAX_CODE_POINT;         // sorts after any character
+        else if (n > 0)
+        {
+            for (c &= 0x7f >> (n + 1); n > 0; n--)
+            {
+                if (i == key.size() || (key[i] & 0xc0) != 0x80)
+                {
+                    // broken sequence: take the nearest character after it
+                    exact = false;
+                    if (i < key.size() && (unsigned char) key[i] >= 0xc0)
+                        c++;
+                    c <<= 6 * n;
+                    break;
+                }
+                c = (c << 6) | (key[i++] & 0x3f);
+            }
+        }
+
+        // symbols are numbered in increasing order of code points
+        unsigned symbol = unsigned(std::lower_bound(alphabet.begin() + 1, alphabet.end(), c) - alphabet.begin());
+        exact = exact && symbol < alphabet.size() && alphabet[symbol] == c;
+        return symbol;
+#else
+        exact = true;
+        return (unsigned char) key[i++];
+#endif
+    }
+
 public:
-    Automaton()
+    // Forward iterator over the words of the automaton in lexicographic order.
+    // The current word is kept in a buffer reused by every step; stepping and
+    // seeking allocate nothing.
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef string value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const string *pointer;
+        typedef const string &reference;
+
+    private:
+        friend class Automaton;
+
+        const Automaton *automaton;
+        vector<unsigned> state;     // state at each depth
+        vector<unsigned> trans;     // current transition at each depth
+        vector<char> sorted;        // the state is in label order
+        vector<size_t> length;      // word length before each depth
+        string word;
+        int depth;                  // -1 past the last word
+
+        explicit const_iterator(const Automaton *a)
+            : automaton(a), state(MAX_STR_LEN + 2), trans(MAX_STR_LEN + 2),
+              sorted(MAX_STR_LEN + 2), length(MAX_STR_LEN + 2), depth(-1)
+        {
+            word.reserve(4 * (MAX_STR_LEN + 2));
+        }
+
+        // Put transition t at the current depth.
+        void setTrans(unsigned t)
+        {
+            trans[depth] = t;
+            word.resize(length[depth]);
+            automaton->appendSymbol(word, automaton->attr(t));
+        }
+
+        // Go to the state reached by the current transition.
+        void push(unsigned pos)
+        {
+            if (++depth > MAX_STR_LEN)
+                throw std::runtime_error("Error in automaton file.");
+            state[depth] = pos;
+            sorted[depth] = automaton->sorted(pos);
+            length[depth] = word.size();
+        }
+
+        // Go to the next transition in depth-first order, skipping the
+        // subtree of the current one if skip is set.
+        void step(bool skip)
+        {
+            unsigned dest = automaton->dest(trans[depth]);
+
+            if (dest && !skip)
+            {
+                push(dest);
+                setTrans(automaton->firstTrans(dest));
+                return;
+            }
+            while (depth >= 0)
+            {
+                unsigned t = automaton->nextTrans(state[depth], trans[depth], sorted[depth] != 0);
+                if (t)
+                {
+                    setTrans(t);
+                    return;
+                }
+                depth--;
+            }
+            word.clear();
+        }
+
+        // Advance to the nearest terminal transition.
+        void settle()
+        {
+            while (depth >= 0 && !automaton->term(trans[depth]))
+                step(false);
+        }
+
+    public:
+        const_iterator() : automaton(nullptr), depth(-1)
+        { }
+
+        reference operator*() const
+        {
+            return word;
+        }
+
+        pointer operator->() const
+        {
+            return &word;
+        }
+
+        const_iterator &operator++()
+        {
+            step(false);
+            settle();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const const_iterator &other) const
+        {
+            if (depth != other.depth)
+                return false;
+            for (int d = depth; d >= 0; d--)
+                if (trans[d] != other.trans[d])
+                    return false;
+            return true;
+        }
+
+        bool operator!=(const const_iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+        // Move to the first word that is not less than key.
+        void seek(const string &key)
+        {
+            const Automaton &a = *automaton;
+            size_t i = 0;
+            bool exact = true;
+
+            depth = -1;
+            word.clear();
+            push(a.startState);
+            setTrans(a.firstTrans(a.startState));
+            if (key.empty())
+            {
+                settle();
+                return;
+            }
+
+            while (true)
+            {
+                unsigned w = a.keySymbol(key, i, exact);
+                unsigned t = w < MAX_CHARS ? a.lowerTrans(state[depth], w) : 0;
+
+                if (t == 0)
+                {
+                    // all the words in this state are less than key
+                    if (--depth >= 0)
+                        step(true);
+                    else
+                        word.clear();
+                    break;
+                }
+                setTrans(t);
+                if (a.attr(t) != w || !exact)
+                    break;              // first word of this subtree is greater
+                if (i == key.size())
+                {
+                    // key is a prefix of all the words in this subtree
+                    break;
+                }
+                unsigned dest = a.dest(t);
+                if (!dest)
+                {
+                    // the current word is a proper prefix of key
+                    step(true);
+                    break;
+                }
+                push(dest);
+                setTrans(a.firstTrans(dest));
+            }
+            settle();
+        }
+    };
+
+    typedef const_iterator iterator;
+
+    Automaton() : startState(0), jumpDepth(0), jumpRadix(0), bloomProbes(0)
     { }
 
     ~Automaton()
     { }
+
+    // Read an automaton saved by "am -m".
+    void load(const string &fileName) override
+    {
+        std::ifstream file(fileName, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Cannot open input file.");
+
+        file.seekg(0, std::ios::end);
+        size_t size = size_t(file.tellg()) / sizeof(unsigned);
+        file.seekg(0, std::ios::beg);
+        automat.resize(size);
+        file.read(reinterpret_cast<char *>(automat.data()), size * sizeof(unsigned));
+        if (size < 1)
+            throw std::runtime_error("Error in input file.");
+
+        // a filter (with its probes and number of words) ends the file
+        bloom.clear();
+        if (automat[0] >> BLOOM_SHIFT & 1)
+        {
+            size_t words = automat[size - 1];
+            if (size <= words + 2 || words == 0 || words % BLOOM_BLOCK != 0)
+                throw std::runtime_error("Error in input file.");
+            bloomProbes = automat[size - 2];
+            size -= words + 2;
+            bloom.assign(automat.begin() + size, automat.begin() + size + words);
+        }
+
+        // a jump table (with its outputs) and the number of its entries
+        // come before it
+        size_t entries = 0;
+        if ((jumpDepth = automat[0] >> JUMP_SHIFT & 3) != 0)
+        {
+            entries = automat[size - 1];
+#ifdef USE_VALUES
+            if (size <= 2 * entries + 1)
+                throw std::runtime_error("Error in input file.");
+            size -= 2 * entries + 1;
+            jumpValues.assign(automat.begin() + size + entries, automat.begin() + size + 2 * entries);
+#else
+            if (size <= entries + 1)
+                throw std::runtime_error("Error in input file.");
+            size -= entries + 1;
+#endif
+            jump.assign(automat.begin() + size, automat.begin() + size + entries);
+        }
+
+#ifdef USE_UTF8
+        // the alphabet follows the transitions (and their outputs)
+        if (size < MAX_CHARS + 1)
+            throw std::runtime_error("Error in input file.");
+        size -= MAX_CHARS;
+        alphabet.assign(1, 0);
+        for (size_t i = size + 1; i < size + MAX_CHARS && automat[i]; i++)
+            alphabet.push_back(automat[i]);
+        jumpRadix = unsigned(alphabet.size());
+#else
+        jumpRadix = MAX_CHARS;
+#endif
+        size_t expected = jumpDepth ? 1 : 0;
+        for (unsigned d = 0; d < jumpDepth; d++)
+            expected *= jumpRadix;
+        if (entries != expected)
+            throw std::runtime_error("Error in input file.");
+#ifdef USE_VALUES
+        size /= 2;
+        values.resize(size);
+        for (size_t i = 0; i < size; i++)
+            values[i] = automat[size + i];
+#endif
+        automat.resize(size);
+        if (size < 1)
+            throw std::runtime_error("Error in input file.");
+        unsigned tag = automat[0] >> LAYOUT_SHIFT;
+        if (tag != 0 && tag != Layout::tag)
+            throw std::runtime_error("The automaton file has another layout of states.");
+        startState = automat[0] & ((1u << BLOOM_SHIFT) - 1);
+        if (startState >= size)
+            throw std::runtime_error("Error in input file.");
+        if (startState == 0)
+            automat.clear();            // no strings at all
+    }
+
+    // Is word in the automaton?
+    bool contains(const string &word) const override
+    {
+        if (automat.empty() || word.empty() || (!bloom.empty() && !mayContain(word)))
+            return false;
+
+        unsigned pos = startState, t = 0;
+        size_t i = 0, k = jumpIndex(word, i);
+        bool exact;
+
+        if (k != noJump)
+        {
+            if ((t = jump[k]) == 0)
+                return false;
+            pos = dest(t);
+        }
+        while (i < word.size())
+        {
+            if (pos == 0)
+                return false;
+            unsigned w = keySymbol(word, i, exact);
+            if (!exact || w >= MAX_CHARS || (t = findTrans(pos, w)) == 0)
+                return false;
+            pos = dest(t);
+        }
+        return term(t);
+    }
+
+#ifdef USE_VALUES
+    // Find the value of a word; the outputs along its path add up to it.
+    bool lookup(const string &word, unsigned &value) const override
+    {
+        if (automat.empty() || word.empty() || (!bloom.empty() && !mayContain(word)))
+            return false;
+
+        unsigned pos = startState, t = 0;
+        size_t i = 0, k = jumpIndex(word, i);
+        bool exact;
+
+        value = 0;
+        if (k != noJump)
+        {
+            if ((t = jump[k]) == 0)
+                return false;
+            value = jumpValues[k];
+            pos = dest(t);
+        }
+        while (i < word.size())
+        {
+            if (pos == 0)
+                return false;
+            unsigned w = keySymbol(word, i, exact);
+            if (!exact || w >= MAX_CHARS || (t = findTrans(pos, w)) == 0)
+                return false;
+            value += values[t];
+            pos = dest(t);
+        }
+        return term(t);
+    }
+#endif
+
+    const_iterator begin() const
+    {
+        return lower_bound(string());
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator();
+    }
+
+    // Iterator to the first word that is not less than key.
+    const_iterator lower_bound(const string &key) const
+    {
+        const_iterator it(this);
+        if (!automat.empty())
+            it.seek(key);
+        return it;
+    }
+
+    // Iterator to the first word that is greater than key.
+    const_iterator upper_bound(const string &key) const
+    {
+        const_iterator it = lower_bound(key);
+        if (it != end() && *it == key)
+            ++it;
+        return it;
+    }
+
+    // Words in [lo, hi), found by descending along both bounds.
+    std::pair<const_iterator, const_iterator> range(const string &lo, const string &hi) const
+    {
+        const_iterator first = lower_bound(lo);
+        if (first == end() || !(*first < hi))
+            return std::make_pair(end(), end());
+        return std::make_pair(first, lower_bound(hi));
+    }
+
+    // Call visit for each word in [lo, hi) in order; an empty hi has no limit.
+    void forEach(const string &lo, const string &hi,
+                 const std::function<void(const string &)> &visit) const override
+    {
+        const_iterator last = hi.empty() ? end() : lower_bound(hi);
+
+        for (const_iterator it = lower_bound(lo); it != last; ++it)
+            visit(*it);
+    }
+
+    // Find the smallest word that is not less than key.
+    bool successor(const string &key, string &word) const override
+    {
+        const_iterator it = lower_bound(key);
+        if (it == end())
+            return false;
+        word = *it;
+        return true;
+    }
+
+    // Find the greatest word that is not greater than key. The key is followed
+    // as long as possible; the deepest branch to a smaller label (or the
+    // longest prefix of key that is a word) gives the answer.
+    bool predecessor(const string &key, string &word) const override
+    {
+        if (automat.empty())
+            return false;
+
+        unsigned pos = startState, best = 0, t;
+        size_t i = 0, bestLength = 0, length;
+        bool exact, bestIsPrefix = false;
+
+        word.clear();
+        while (i < key.size())
+        {
+            length = word.size();
+            unsigned w = keySymbol(key, i, exact);
+            // if the key character is absent, w is the first symbol after it
+            if ((t = lessTrans(pos, w)) != 0)
+            {
+                best = t;
+                bestLength = length;
+                bestIsPrefix = false;
+            }
+            if (!exact || w >= MAX_CHARS || (t = findTrans(pos, w)) == 0)
+                break;
+            appendSymbol(word, w);
+            if (term(t))
+            {
+                if (i == key.size())
+                    return true;        // key itself
+                best = t;
+                bestLength = word.size();
+                bestIsPrefix = true;
+            }
+            if ((pos = dest(t)) == 0)
+                break;
+        }
+
+        if (!best)
+            return false;
+        word.resize(bestLength);
+        if (!bestIsPrefix)
+        {
+            // the greatest word in the subtree of best
+            for (t = best; ; t = lastTrans(dest(t)))
+            {
+                appendSymbol(word, attr(t));
+                if (!dest(t))
+                    break;
+            }
+        }
+        return true;
+    }
 };
+
+// Load an automaton saved by "am" with any layout of states. The layout is
+// read from the file, and an Automaton specialized for it is returned; files
+// written before the layout was recorded are taken to have DefaultLayout.
+inline std::unique_ptr<AutomatonInterface> loadAutomaton(const string &fileName)
+{
+    std::ifstream file(fileName, std::ios::binary);
+    unsigned first = 0;
+
+    if (!file.read(reinterpret_cast<char *>(&first), sizeof first))
+        throw std::runtime_error("Cannot open input file.");
+    file.close();
+
+    std::unique_ptr<AutomatonInterface> automaton;
+    switch (first >> LAYOUT_SHIFT)
+    {
+    case 0:
+        automaton.reset(new Automaton<>());
+        break;
+    case LAYOUT_FLAT:
+        automaton.reset(new Automaton<list<string>, tree<string>, FlatLayout>());
+        break;
+    case LAYOUT_TREE:
+        automaton.reset(new Automaton<list<string>, tree<string>, TreeLayout>());
+        break;
+    case LAYOUT_INCLUSION:
+        automaton.reset(new Automaton<list<string>, tree<string>, InclusionLayout>());
+        break;
+    default:
+        throw std::runtime_error("Unknown layout of states.");
+    }
+    automaton->load(fileName);
+    return automaton;
+}
@@ -21,47 +21,46 @@ prefixes are correct words were reported as correct
 
 #include "cd00.h"
 
-#define PRINT_STATISTICS
-/*#define USE_TREE          /* represent states in complete binary trees */
-/*#define USE_INCLUSION     /* enable including states */
-
-#define MAX_STR_LEN         300
-#define MAX_CHARS           256
 #define HT_SIZE             (1 << 20)
 #define HT_ELEM_SIZE        (1 << 10)
-#ifndef USE_TREE
-#define MAX_AUT_SIZE        (1 << 22)
-#else
-#define MAX_AUT_SIZE        (1 << 21)
-#endif
-
-typedef union
-{
-    unsigned all_fields;
-    struct
-    {
+#define LIST_BUF_SIZE       (1 << 20)   /* output buffer for listing */
+#define MAX_THREADS         64
+#define MIN_GC_SIZE         (1 << 16)   /* least garbage worth collecting */
+#define DELTA_SIZE          (1 << 16)   /* changes kept before a merge */
+#define RELOAD_ROUNDS       4           /* passes of each reader (-h) */
+#define RADIX_CUTOFF        32          /* smaller arrays are sorted
+                                           by insertion */
+#define SORT_TASKS          16          /* sorting tasks per thread (-r) */
+#define RING_SIZE           4096        /* words queued for the builder (-b) */
+#define RUN_SIZE            (1 << 26)   /* lexicon bytes per sorted run */
+#define MAX_RUNS            128         /* runs merged at once (-x) */
+#define MAX_LEVELS          8           /* levels of merged runs (-x) */
+#define TUNE_QUERIES        (1 << 16)   /* lookups replayed for each */
+#define TUNE_ROUNDS         5           /* layout, and how many times */
+#define BENCH_WORDS         (1 << 20)   /* transitions in states timed by -k */
+#define BENCH_QUERIES       (1 << 22)   /* lookups timed for each size */
+#define JUMP_NONE           ((size_t) -1)   /* string shorter than the table */
+#define BLOOM_BITS          10          /* bits per string of the filter */
+#define PACK_BLOCK          256         /* transitions in a packed block */
+#define PACK_CACHE          64          /* blocks kept unpacked (-y) */
+#define PACK_WORDS          128         /* transitions coded in one byte */
 #ifdef USE_TREE
-        unsigned llast : 1;
-        unsigned rlast : 1;
-        unsigned dest : 21;
+#define PACK_FLAGS          2           /* llast and rlast */
 #else
-        unsigned last : 1;
-        unsigned dest : 22;
-#endif
-        unsigned attr : 8;
-        unsigned term : 1;
-    } b;
-#ifdef USE_INCLUSION
-    struct
-    {
-        unsigned last : 1;
-        unsigned dest_attr_term : 31;
-    } d;
+#define PACK_FLAGS          1           /* last */
 #endif
-} transition;
-
-typedef int sizeof_unsigned_int_must_match_sizeof_transition
-[2 * (sizeof(unsigned) == sizeof(transition)) - 1];
+/* fields of a transition word in any layout (see transition in cd00.h) */
+#define RAW_LABEL(w)        ((w) >> 23 & 0xff)
+#define RAW_TERM(w)         ((w) >> 31)
+#define RAW_LABEL_TERM      0xff800000u
+#define FLAT_LAST(w)        ((w) & 1)
+#define FLAT_DEST(w)        ((w) >> 1 & 0x3fffff)
+#define TREE_LLAST(w)       ((w) & 1)
+#define TREE_RLAST(w)       ((w) >> 1 & 1)
+#define TREE_DEST(w)        ((w) >> 2 & 0x1fffff)
+#define RAW_FLAT(c)         (((c) & RAW_LABEL_TERM) | ((c) & 0x3fffff) << 1)
+#define RAW_TREE(c)         (((c) & RAW_LABEL_TERM) | ((c) & 0x1fffff) << 2)
+#define HASH_PAIR(a, b)     ((size_t) (a) * 2654435761u ^ (size_t) (b) * 40503u)
 
 typedef struct tbucket
 {
@@ -70,33 +69,260 @@ typedef struct tbucket
     struct tbucket *next;
 } bucket;
 
+#ifdef USE_INCLUSION
+/*
+** A list of hash_table_in has one head entry for each state size,
+** in increasing order; key of a head is the first entry of a state
+** of that size, and these entries are linked with next.
+*/
+typedef struct
+{
+    unsigned key;               /* transition the state is filed under */
+    unsigned addr : 23;         /* position of the state */
+    unsigned size : 9;          /* its number of transitions */
+    unsigned next;              /* next entry in the list, or 0 */
+} in_entry;
+
+#define IN_ENTRY(i)         (ht_elem_in[(i) / HT_ELEM_SIZE][(i) % HT_ELEM_SIZE])
+#endif
+
+typedef struct
+{
+    unsigned char *data;        /* buffered output */
+    size_t len;                 /* bytes used */
+    size_t size;                /* bytes allocated */
+    FILE *file;                 /* flush here when full, grow if NULL */
+    int coded;                  /* write strings front-coded */
+    size_t shared;              /* bytes shared with the last string */
+    volatile long *turn;        /* if not NULL, write only when *turn */
+    long ticket;                /* reaches ticket */
+    unsigned long n_strings;
+    unsigned long n_chars;
+} out_buffer;
+
+typedef struct
+{
+    unsigned char str[MAX_STR_LEN + 2];     /* string of symbols */
+    size_t len;                 /* its length, 0 ends the lexicon */
+    size_t prefix;              /* common prefix with the string before */
+#ifdef USE_VALUES
+    unsigned value;
+#endif
+} ring_entry;
+
+typedef struct
+{
+    transition *trans;          /* transitions */
+    unsigned size;              /* number of transitions */
+    unsigned start;             /* position of the start state */
+#ifdef USE_VALUES
+    unsigned *values;           /* output of each transition */
+#endif
+#ifdef USE_UTF8
+    unsigned alphabet[MAX_CHARS];   /* code point of each symbol */
+#endif
+    int jump_depth;             /* depth of the jump table in the file */
+    int bloom;                  /* the file has a filter */
+} automaton;
+
+typedef struct
+{
+    unsigned char **slot;       /* marked strings ("+s" or "-s"), or NULL */
+    size_t size;                /* number of slots, a power of 2 */
+    size_t count;               /* number of strings */
+} delta;
+
+typedef struct
+{
+    automaton *aut;
+    unsigned state[MAX_STR_LEN + 2];    /* state at each depth */
+    unsigned trans[MAX_STR_LEN + 2];    /* current transition at each depth */
+    int sorted[MAX_STR_LEN + 2];        /* the state is in label order */
+    size_t len[MAX_STR_LEN + 3];        /* string length up to each depth */
+    unsigned char str[4 * (MAX_STR_LEN + 2)];
+    int depth;                          /* -1 at the end */
+} walker;
+
+typedef struct
+{
+    automaton *volatile image;          /* the published automaton */
+    volatile long epoch;                /* number of images published */
+    volatile long reader[MAX_THREADS];  /* epoch seen by each reader, */
+                                        /* 0 when not reading */
+} reloadable;
+
+typedef struct
+{
+    char *magic;                /* first bytes of a compressed file */
+    size_t magic_len;
+    char *ext;                  /* file name extension */
+    char *unpack;               /* command decompressing stdin to stdout */
+    char *pack;                 /* command compressing stdin to stdout */
+} codec;
+
+typedef struct
+{
+    unsigned trans;             /* transition to list from */
+    unsigned char prefix[8];    /* labels before it */
+    size_t len;                 /* length of the prefix */
+#ifdef USE_VALUES
+    unsigned value;             /* value of the prefix */
+#endif
+    int deep;                   /* list the strings below it too */
+} list_task;
+
+typedef struct
+{
+    unsigned begin;             /* first string of the bucket */
+    unsigned len;               /* number of strings */
+    unsigned depth;             /* the strings are equal up to depth */
+} sort_task;
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef DWORD (WINAPI *thread_fun)(LPVOID);
+#define THREAD_FUN(name)    DWORD WINAPI name(LPVOID arg)
+#define ATOMIC_NEXT(p)      (InterlockedIncrement(p) - 1)
+#define ATOMIC_SWAP(p, v)   InterlockedExchangePointer((PVOID volatile *) (p), (v))
+#define MEMORY_BARRIER()    MemoryBarrier()
+#define YIELD()             SwitchToThread()
+#define PREFETCH(p)         PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (p))
+#define popen               _popen
+#define pclose              _pclose
+#else
+typedef pthread_t thread_t;
+typedef void *(*thread_fun)(void *);
+#define THREAD_FUN(name)    void *name(void *arg)
+#define ATOMIC_NEXT(p)      __sync_fetch_and_add(p, 1)
+#define ATOMIC_SWAP(p, v)   __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define MEMORY_BARRIER()    __sync_synchronize()
+#define YIELD()             sched_yield()
+#define PREFETCH(p)         __builtin_prefetch(p)
+#endif
+
 unsigned long n_strings;            /* number of strings */
 unsigned long n_chars;              /* number of characters */
+#ifdef USE_UTF8
+unsigned long n_symbols;            /* number of decoded characters */
+#endif
 
 bucket *hash_table[HT_SIZE];
 bucket *ht_elem[MAX_AUT_SIZE / HT_ELEM_SIZE];
 int ht_next_elem, ht_last_pos;
 
 #ifdef USE_INCLUSION
-bucket *hash_table_in[HT_SIZE];
-bucket *ht_elem_in[MAX_AUT_SIZE / HT_ELEM_SIZE];
-int ht_next_elem_in, ht_last_pos_in;
+unsigned hash_table_in[HT_SIZE];    /* first entry of each list, or 0 */
+in_entry *ht_elem_in[2 * MAX_AUT_SIZE / HT_ELEM_SIZE];
+unsigned ht_next_in;                /* next free entry */
+int ht_last_pos_in;
 unsigned hash_table_in_count[HT_SIZE];
-int frozen_states[MAX_AUT_SIZE];
+unsigned char frozen_states[MAX_AUT_SIZE];   /* reorganized states */
+int use_inclusion = 1;              /* look for states to include */
 #endif
 
 transition automat[MAX_AUT_SIZE];   /* the automaton */
 unsigned aut_size;                  /* size of the automaton */
 unsigned start_state;               /* position of the start state */
+unsigned aut_layout = LAYOUT;       /* layout of states in automat */
+int new_jump_depth;                 /* depth of the jump table saved (-j) */
+unsigned *jump_table;               /* transition reached by the first */
+int jump_depth;                     /* jump_depth symbols, or 0 */
+size_t jump_size;                   /* number of entries */
+unsigned jump_radix;                /* symbols at each level */
+#ifdef USE_VALUES
+unsigned *jump_value;               /* sum of outputs on the way */
+#endif
+int new_bloom_bits;                 /* bits per string of the filter saved
+                                       (-n) */
+unsigned *bloom_filter;             /* blocked Bloom filter of the strings */
+unsigned bloom_blocks;              /* number of its blocks */
+unsigned bloom_probes;              /* bits set for each string */
+unsigned pack_dict[PACK_WORDS];     /* frequent transitions of a packed */
+unsigned pack_dict_size;            /* automaton, sorted */
+unsigned pack_blocks;               /* number of its blocks */
+unsigned *pack_index;               /* offset of each block and the end */
+unsigned char *pack_data;           /* the packed blocks */
+unsigned *pack_slot;                /* cache slot of each block + 1, or 0 */
+unsigned pack_cache[PACK_CACHE][PACK_BLOCK];    /* unpacked blocks */
+#ifdef USE_VALUES
+unsigned pack_cache_value[PACK_CACHE][PACK_BLOCK];
+#endif
+unsigned pack_owner[PACK_CACHE];    /* block in each slot + 1, or 0 */
+unsigned long pack_used[PACK_CACHE];    /* when each slot was last used */
+unsigned long pack_clock;           /* number of times a slot was used */
+unsigned pack_last = UINT_MAX;      /* block used last */
+unsigned *pack_words;               /* its transitions */
+#ifdef USE_VALUES
+unsigned *pack_values;              /* and their outputs */
+#endif
+unsigned long pack_hits, pack_misses;   /* blocks found in the cache */
 transition larval_state[MAX_STR_LEN + 1][MAX_CHARS];
 size_t l_state_len[MAX_STR_LEN + 1];
 int is_terminal[MAX_STR_LEN + 1];
-unsigned char temp_str[MAX_STR_LEN + 1];  /* string for listing */
+unsigned char temp_str[MAX_STR_LEN + 1];  /* string for testing */
+unsigned char last_str[MAX_STR_LEN + 1];  /* last string added */
+size_t last_len;                          /* its length */
+#ifdef USE_VALUES
+unsigned automat_value[MAX_AUT_SIZE];     /* output of each transition */
+unsigned larval_value[MAX_STR_LEN + 1][MAX_CHARS];
+unsigned last_value[MAX_STR_LEN + 1];     /* outputs along last_str */
+unsigned str_value;                       /* value of the string read */
+#endif
+
+automaton set_a, set_b;             /* arguments of a set operation */
+unsigned map_a[MAX_CHARS];          /* symbols of set_a in the result */
+unsigned map_b[MAX_CHARS];          /* symbols of set_b in the result */
+unsigned char set_str[MAX_STR_LEN + 1];   /* current string of the result */
+size_t set_lcp;                     /* prefix shared with the last string */
+#ifdef USE_VALUES
+unsigned set_value_a[MAX_STR_LEN + 1];  /* value of set_str in set_a */
+unsigned set_value_b[MAX_STR_LEN + 1];  /* value of set_str in set_b */
+#endif
+
+unsigned *pair_table;               /* pairs of equal states (for diff) */
+size_t pair_size, pair_count;
+unsigned char diff_str[1 + 4 * (MAX_STR_LEN + 1)];  /* mark and string */
+out_buffer diff_out;                /* differences */
+unsigned long n_added, n_removed;   /* number of differing strings */
 #ifdef USE_TREE
 transition temp_state[MAX_CHARS + 1];
 #endif
 
+unsigned char fold_table[MAX_CHARS];    /* folded form of each character */
+unsigned char fold_next[MAX_CHARS];     /* next character of the same form */
+unsigned char *fold_str;                /* string of a folding lookup */
+unsigned *fold_memo;        /* states that failed at a position of fold_str */
+size_t fold_memo_size, fold_memo_count;     /* (3 words each with lookup) */
+unsigned fold_lookup;                   /* number of the folding lookup */
+
+#ifdef USE_UTF8
+unsigned alphabet[MAX_CHARS];           /* code point of each symbol */
+unsigned alphabet_size;                 /* number of symbols in use */
+unsigned char *symbol_page[MAX_CODE_POINT >> 8];   /* code point -> symbol */
+unsigned char *fold_page[MAX_CODE_POINT >> 8];     /* unknown code point ->
+                                                      folded symbol */
+unsigned char code_used[MAX_CODE_POINT / 8];       /* code points in the
+                                                      lexicon */
+#define NEXT_SYMBOL(s)      code_to_symbol(decode_utf8(&(s)))
+#else
+#define NEXT_SYMBOL(s)      (*(s)++)
+#endif
+
 FILE *lex_file;                     /* lexicon file */
+char *dict_command;                 /* command piped to lex_file or NULL */
+int dict_input;                     /* lex_file is read */
+int front_coded;                    /* lexicon files are front-coded */
+unsigned char coded_str[MAX_STR_LEN + 1];  /* last string read from */
+size_t coded_len;                          /* a front-coded file */
+size_t coded_prefix;                /* bytes it shares with the one before */
+codec codecs[] =
+{
+    {"\x1f\x8b", 2, ".gz", "gzip -dc", "gzip -c"},
+    {"\x28\xb5\x2f\xfd", 4, ".zst", "zstd -dcq", "zstd -cq"},
+    {"\xfd" "7zXZ", 5, ".xz", "xz -dc", "xz -c"},
+    {"BZh", 3, ".bz2", "bzip2 -dc", "bzip2 -c"}
+};
+#define N_CODECS            (sizeof codecs / sizeof *codecs)
 FILE *aut_file;                     /* automaton file */
 
 #ifdef PRINT_STATISTICS
@@ -110,34 +336,210 @@ unsigned n_trans_in;           /* number of included transitions */
 #endif
 
 int check_string(unsigned char *str);
+int check_string_fold(unsigned char *str);
+int fold_failed(unsigned pos, unsigned i);
+void add_fold_failure(unsigned pos, unsigned i);
+int check_fold(unsigned pos, unsigned char *str);
+void add_fold_class(unsigned char *cls);
+#ifdef USE_UTF8
+unsigned decode_utf8(unsigned char **str);
+int encode_utf8(unsigned c, unsigned char *str);
+unsigned code_to_symbol(unsigned c);
+unsigned fold_symbol(unsigned c);
+unsigned char get_page(unsigned char **pages, unsigned c);
+void set_page(unsigned char **pages, unsigned c, unsigned char value);
+void mark_code_points(unsigned char *str);
+void number_code_points(void);
+void make_alphabet(size_t skip);
+void use_alphabet(unsigned *codes);
+void merge_alphabets(unsigned *codes_a, unsigned *codes_b);
+size_t decode_string(unsigned char *str);
+#endif
 void error(char *msg);
 unsigned hash_state(transition *state, unsigned state_len);
-#ifdef USE_TREE
-void list_strings(unsigned pos, int str_pos, int tree_pos);
+#ifdef USE_VALUES
+void list_strings(unsigned pos, unsigned char *prefix, size_t prefix_len,
+                  unsigned value, out_buffer *out);
+void put_value(out_buffer *out, unsigned char *str, size_t len,
+               unsigned value);
+#else
+void list_strings(unsigned pos, unsigned char *prefix, size_t prefix_len,
+                  out_buffer *out);
+#endif
+void list_automat(void);
+#ifdef USE_VALUES
+void add_list_task(unsigned t, unsigned char *prefix, size_t len,
+                   unsigned value, int deep);
 #else
-void list_strings(unsigned pos, int str_pos);
+void add_list_task(unsigned t, unsigned char *prefix, size_t len, int deep);
 #endif
+void list_automat_parallel(void);
+THREAD_FUN(list_worker);
+unsigned first_trans(transition *aut, unsigned pos, int *sorted);
+unsigned next_trans(transition *aut, unsigned pos, unsigned t, int sorted);
 void make_automat(void);
+void add_lexicon(void);
+void add_mapped_lexicon(unsigned char *text, size_t size);
+size_t common_prefix(const unsigned char *a, const unsigned char *b, size_t n);
+THREAD_FUN(pipe_reader);
+void make_automat_pipelined(void);
+void insertion_sort(unsigned char **a, size_t n, size_t depth);
+void radix_sort(unsigned char **a, size_t n, size_t depth,
+                unsigned char **tmp);
+void split_bucket(unsigned begin, unsigned len, unsigned depth);
+THREAD_FUN(sort_worker);
+void sort_lexicon(unsigned char **a, size_t n);
+unsigned char **cut_lines(unsigned char *text, size_t size, size_t *n);
+size_t sort_unique(unsigned char **lines, size_t n);
+#ifdef USE_VALUES
+unsigned line_value(const unsigned char *str);
+#endif
+#ifdef USE_UTF8
+void mark_lines(unsigned char **lines, size_t n);
+#endif
+void add_sorted_string(unsigned char *str);
+void make_automat_unsorted(void);
+int read_run(int r);
+int run_before(int a, int b);
+void sift_run(int i, int n);
+void merge_runs(FILE *out);
+FILE *merge_level(int level);
+void add_run(FILE *f, int level);
+void write_run(unsigned char **lines, size_t n);
+void make_automat_external(void);
+#ifndef USE_VALUES
+unsigned tree_words(unsigned *aut, unsigned pos, unsigned k,
+                    unsigned *trans, unsigned n);
+void place_tree(unsigned *trans, int left, int right, unsigned *state,
+                unsigned k, int full);
+unsigned *convert_image(unsigned *aut, unsigned size, unsigned start,
+                        unsigned from, unsigned to);
+int tune_lookup(unsigned *aut, unsigned layout, unsigned start,
+                unsigned char *str, size_t len);
+void read_queries(size_t stride);
+unsigned *copy_image(void);
+void tune_automat(char *objective, char *query_name);
+#endif
+void register_state(unsigned hash_addr, unsigned addr, unsigned size);
+#ifndef USE_INCLUSION
+void register_states(unsigned pos);
+void rebuild_register(void);
+void reopen_automat(void);
+void append_automat(char *fname);
+#ifndef USE_VALUES
+unsigned copy_state(unsigned pos, unsigned old, transition new_trans,
+                    transition *state);
+int edit_string(unsigned char *str, size_t q, int add);
+void mark_states(unsigned pos, unsigned *new_pos);
+void compact_automat(void);
+void edit_automat(char *fname);
+#endif
+#endif
+void start_automat(void);
+void add_string(unsigned char *str, size_t q, size_t p);
+void finish_automat(void);
+int in_result(int op, int in_a, int in_b);
+void combine_states(int op, unsigned sa, unsigned sb, size_t len);
+void combine_automata(int op, char *name_a, char *name_b);
+int find_pair(unsigned sa, unsigned sb);
+void add_pair(unsigned sa, unsigned sb);
+int diff_states(unsigned sa, unsigned sb, size_t depth, size_t len);
+void diff_automata(char *name_a, char *name_b);
+size_t hash_string(unsigned char *str);
+unsigned char **delta_find(delta *d, unsigned char *str);
+void delta_put(delta *d, unsigned char *line);
+void delta_free(delta *d);
+#ifdef USE_UTF8
+unsigned find_symbol(unsigned *codes, unsigned c);
+#endif
+int find_string(automaton *a, unsigned char *str);
+void walk_start(walker *w, automaton *a);
+size_t walk_next(walker *w);
+int compare_marked(const void *a, const void *b);
+void merge_delta(automaton *base, delta *d, automaton *result);
+THREAD_FUN(merge_worker);
+void start_merge(void);
+void finish_merge(void);
+int tiered_check(unsigned char *str);
+void tiered_automat(char *aut_name, char *out_name);
+automaton *load_image(char *fname);
+void free_image(automaton *a);
+automaton *enter_reader(reloadable *h, int reader);
+void leave_reader(reloadable *h, int reader);
+void reload_automat(reloadable *h, char *fname);
+THREAD_FUN(reload_reader);
+void reload_test(char *aut_name);
+#ifdef USE_VALUES
+unsigned make_state(transition *state, unsigned *state_value,
+                    unsigned state_len);
+#else
 unsigned make_state(transition *state, unsigned state_len);
+#endif
 #ifdef USE_TREE
 void make_tree(transition *state, int left, int right, unsigned pos, int full);
+unsigned find_in_tree(unsigned pos, unsigned w);
+unsigned find_in_tree_loop(unsigned pos, unsigned w);
+void bench_tree_search(void);
 #endif
 #ifdef USE_INCLUSION
 unsigned hash_fun_in(unsigned p);
+unsigned new_entry_in(void);
 void add_state_in(int first, int last);
 int find_subset(transition *state, unsigned state_len);
 int reorganize_state(unsigned pos, transition *state, unsigned state_len);
-void sort_bucket(bucket *ptr);
-bucket *mergesort(bucket *p);
 #endif
 void prepare_tables(void);
+void free_tables(void);
+void prepare_fold_table(void);
+void link_fold_table(void);
+void read_fold_table(char *fname);
 void read_automat(char *aut_name);
+void load_automat(char *fname, automaton *a);
 int read_string(unsigned char *str);
+int read_coded_string(unsigned char *str);
+#ifdef USE_VALUES
+size_t split_value(unsigned char *str, size_t len);
+size_t span_value(const unsigned char *str, size_t len, unsigned *value);
+#endif
 void save_automat(char *aut_name);
+void make_jump_table(void);
+void fill_jump_table(unsigned pos, int depth, size_t index, unsigned value);
+void read_jump_table(char *fname, int depth);
+size_t jump_index(unsigned char **str);
+long skip_trailer(long size, unsigned entry_size, unsigned extra);
+unsigned bloom_hash(unsigned char *str);
+unsigned bloom_mix(unsigned h);
+int bloom_probe(unsigned h, int set);
+void make_bloom_filter(void);
+void read_bloom_filter(char *fname);
+#ifdef PRINT_STATISTICS
+void bloom_stat(void);
+#endif
+int compare_words(const void *a, const void *b);
+void make_pack_dict(void);
+size_t pack_trans(unsigned p, unsigned char *out);
+void pack_automat(char *fname);
+void read_packed(char *fname);
+void unpack_block(unsigned b, unsigned slot);
+void use_block(unsigned b);
+int check_packed(unsigned char *str);
 void open_dict(char *fname, char *attr);
+char *pipe_command(char *command, char *redirect, char *fname);
+void rewind_dict(void);
+void close_dict(void);
+void put_string(out_buffer *out, unsigned char *str, size_t len);
+void make_room(out_buffer *out, size_t len);
+void flush_buffer(out_buffer *out);
+void start_buffer(out_buffer *out, FILE *file, size_t size, int coded);
+void start_thread(thread_t *thread, thread_fun fun, void *arg);
+void join_thread(thread_t thread);
+int count_cpus(void);
 void set_io_buffer(FILE *file, size_t size);
+unsigned char *map_file(FILE *file, size_t *size);
+int regular_file(FILE *file);
+void unmap_file(unsigned char *text, size_t size);
 void show_stat(double dt);
-void test_automat(void);
+void test_automat(int (*check)(unsigned char *));
 
 /*
 ** Print an error message and terminate the program.
@@ -158,7 +560,7 @@ void prepare_tables(void)
     {
         hash_table[i] = NULL;
 #ifdef USE_INCLUSION
-        hash_table_in[i] = NULL;
+        hash_table_in[i] = 0;
         hash_table_in_count[i] = 0;
 #endif
     }
@@ -168,10 +570,10 @@ void prepare_tables(void)
     ht_last_pos = -1;
     ht_next_elem = HT_ELEM_SIZE;
 #ifdef USE_INCLUSION
-    for (i = MAX_AUT_SIZE / HT_ELEM_SIZE - 1; i >= 0; i--)
+    for (i = 2 * MAX_AUT_SIZE / HT_ELEM_SIZE - 1; i >= 0; i--)
         ht_elem_in[i] = NULL;
     ht_last_pos_in = -1;
-    ht_next_elem_in = HT_ELEM_SIZE;
+    ht_next_in = 1;                     /* entry 0 ends the lists */
 #endif
 
     aut_size = 0;
@@ -179,6 +581,23 @@ void prepare_tables(void)
         l_state_len[i] = 0;
 }
 
+/*
+** Free the hash table of a finished automaton.
+*/
+void free_tables(void)
+{
+    int i;
+
+    for (i = 0; i <= ht_last_pos; i++)
+        free(ht_elem[i]);
+    ht_last_pos = -1;
+#ifdef USE_INCLUSION
+    for (i = 0; i <= ht_last_pos_in; i++)
+        free(ht_elem_in[i]);
+    ht_last_pos_in = -1;
+#endif
+}
+
 /*
 ** Set buffer for io stream.
 */
@@ -188,26 +607,423 @@ void set_io_buffer(FILE *file, size_t size)
         error("Cannot set input buffer.");
 }
 
+/*
+** Map a regular file into memory for reading and put its size
+** into size. Return NULL if the file cannot be mapped or is empty.
+*/
+unsigned char *map_file(FILE *file, size_t *size)
+{
+    void *text;
+#ifdef _WIN32
+    HANDLE handle = (HANDLE) _get_osfhandle(_fileno(file)), mapping;
+    LARGE_INTEGER file_size;
+
+    if (!GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0
+        || (unsigned long long) file_size.QuadPart > (size_t) -1)
+        return NULL;
+    if ((mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0,
+                                     NULL)) == NULL)
+        return NULL;
+    text = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (text == NULL)
+        return NULL;
+    *size = (size_t) file_size.QuadPart;
+#else
+    struct stat st;
+
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size == 0 || (unsigned long long) st.st_size > (size_t) -1)
+        return NULL;
+    text = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                fileno(file), 0);
+    if (text == MAP_FAILED)
+        return NULL;
+    *size = (size_t) st.st_size;
+    madvise(text, *size, MADV_SEQUENTIAL);
+#endif
+    return (unsigned char *) text;
+}
+
+/*
+** Return nonzero if file is a regular file, which can be read again
+** from the beginning.
+*/
+int regular_file(FILE *file)
+{
+#ifdef _WIN32
+    return GetFileType((HANDLE) _get_osfhandle(_fileno(file)))
+           == FILE_TYPE_DISK;
+#else
+    struct stat st;
+
+    return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+/*
+** Unmap a file mapped with map_file.
+*/
+void unmap_file(unsigned char *text, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(text);
+#else
+    munmap(text, size);
+#endif
+}
+
 /*
 ** Read next string from input file and return its length.
+** Lines with an empty string are skipped and not counted.
+** The last line needs no line end, as in the other readers.
 */
 int read_string(unsigned char *str)
 {
-    int c, i;
+    int c, i, len;
+
+    if (front_coded)
+        return read_coded_string(str);
+    do
+    {
+        for (i = 0; (c = getc(lex_file)) != '\n'; str[i++] = (unsigned char) c)
+        {
+            if (c == EOF)
+            {
+                if (i == 0)
+                    return 0;
+                break;
+            }
+            if (i > MAX_STR_LEN)
+                error("Lexicon string too long.");
+        }
+        str[len = i] = '\0';
+#ifdef USE_VALUES
+        i = (int) split_value(str, i);
+#endif
+    } while (i == 0);
+    n_strings++;
+    n_chars += len + 1;
+    return i;
+}
+
+/*
+** Read the next string from a front-coded lexicon file (see put_string)
+** and return its length. The shared bytes are taken from coded_str.
+*/
+int read_coded_string(unsigned char *str)
+{
+    int c, i, len;
+    size_t p;
 
-    for (i = 0; (c = getc(lex_file)) != '\n'; str[i++] = (unsigned char) c)
+    do
     {
+        p = 0;
+        while ((c = getc(lex_file)) == 255)
+            p += 255;
         if (c == EOF)
             return 0;
-        if (i > MAX_STR_LEN)
-            error("Lexicon string too long.");
+        if ((p += c) > coded_len)
+            error("Malformed front-coded lexicon.");
+        memcpy(str, coded_str, p);
+        for (i = (int) p; (c = getc(lex_file)) != '\n';
+             str[i++] = (unsigned char) c)
+        {
+            if (c == EOF)
+                break;          /* the last line needs no line end */
+            if (i > MAX_STR_LEN)
+                error("Lexicon string too long.");
+        }
+        str[len = i] = '\0';
+#ifdef USE_VALUES
+        i = (int) split_value(str, i);
+#endif
+    } while (i == 0);           /* as read_string does */
+    n_strings++;
+    n_chars += len + 1;
+    memcpy(coded_str, str, i);
+    coded_len = i;
+    coded_prefix = p;
+    return i;
+}
+
+#ifdef USE_VALUES
+/*
+** Cut off the value that follows the last tab of a string, put it
+** into str_value (0 if there is none) and return the new length.
+*/
+size_t split_value(unsigned char *str, size_t len)
+{
+    str[len = span_value(str, len, &str_value)] = '\0';
+    return len;
+}
+
+/*
+** Like split_value, but put the value into *value, leave the string
+** of len bytes untouched and do not need it to be terminated.
+*/
+size_t span_value(const unsigned char *str, size_t len, unsigned *value)
+{
+    size_t i = len, j;
+
+    *value = 0;
+    while (i > 0 && str[i - 1] != '\t')
+        i--;
+    if (i == 0)
+        return len;
+    for (j = i; j < len && str[j] >= '0' && str[j] <= '9'; j++)
+        *value = *value * 10 + (str[j] - '0');
+    return i - 1;
+}
+#endif
+
+#ifdef USE_UTF8
+/*
+** Decode an UTF-8 character and move the string pointer past it.
+** Return its code point or MAX_CODE_POINT for a malformed sequence.
+*/
+unsigned decode_utf8(unsigned char **str)
+{
+    unsigned char *p = *str;
+    unsigned c = *p++;
+    int n;
+
+    if (c < 0x80)
+        n = 0;
+    else if (c < 0xc2)
+        n = -1;
+    else if (c < 0xe0)
+    {
+        n = 1;
+        c &= 0x1f;
+    }
+    else if (c < 0xf0)
+    {
+        n = 2;
+        c &= 0x0f;
+    }
+    else if (c < 0xf5)
+    {
+        n = 3;
+        c &= 0x07;
+    }
+    else
+        n = -1;
+
+    for (; n > 0; n--)
+    {
+        if ((*p & 0xc0) != 0x80)
+            break;
+        c = (c << 6) | (*p++ & 0x3f);
+    }
+    *str = p;
+
+    return n == 0 && c < MAX_CODE_POINT ? c : MAX_CODE_POINT;
+}
+
+/*
+** Write the UTF-8 form of a code point. Return its length.
+*/
+int encode_utf8(unsigned c, unsigned char *str)
+{
+    if (c < 0x80)
+    {
+        str[0] = (unsigned char) c;
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        str[0] = (unsigned char) (0xc0 | (c >> 6));
+        str[1] = (unsigned char) (0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000)
+    {
+        str[0] = (unsigned char) (0xe0 | (c >> 12));
+        str[1] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+        str[2] = (unsigned char) (0x80 | (c & 0x3f));
+        return 3;
+    }
+    str[0] = (unsigned char) (0xf0 | (c >> 18));
+    str[1] = (unsigned char) (0x80 | ((c >> 12) & 0x3f));
+    str[2] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+    str[3] = (unsigned char) (0x80 | (c & 0x3f));
+    return 4;
+}
+
+/*
+** Get a value from a two-level table indexed by code points.
+*/
+unsigned char get_page(unsigned char **pages, unsigned c)
+{
+    if (c >= MAX_CODE_POINT || pages[c >> 8] == NULL)
+        return 0;
+    return pages[c >> 8][c & 0xff];
+}
+
+/*
+** Put a value into a two-level table indexed by code points.
+*/
+void set_page(unsigned char **pages, unsigned c, unsigned char value)
+{
+    if (pages[c >> 8] == NULL
+        && (pages[c >> 8] = (unsigned char *) calloc(256, 1)) == NULL)
+        error("Not enough memory.");
+    pages[c >> 8][c & 0xff] = value;
+}
+
+/*
+** Return the symbol of a code point or MAX_CHARS
+** if it does not occur in the automaton.
+*/
+unsigned code_to_symbol(unsigned c)
+{
+    unsigned s = get_page(symbol_page, c);
+
+    return s ? s : MAX_CHARS;
+}
+
+/*
+** Return the symbol of a code point, also for code points
+** outside the alphabet that fold to a symbol in it.
+*/
+unsigned fold_symbol(unsigned c)
+{
+    unsigned s = get_page(symbol_page, c);
+
+    if (!s)
+        s = get_page(fold_page, c);
+    return s ? s : MAX_CHARS;
+}
+
+/*
+** Make the given code points the alphabet of the automaton.
+*/
+void use_alphabet(unsigned *codes)
+{
+    memcpy(alphabet, codes, sizeof alphabet);
+    for (alphabet_size = 1; alphabet_size < MAX_CHARS
+         && alphabet[alphabet_size]; alphabet_size++)
+    {
+        if (alphabet[alphabet_size] >= MAX_CODE_POINT)
+            error("Error in input file.");
+        set_page(symbol_page, alphabet[alphabet_size],
+                 (unsigned char) alphabet_size);
+    }
+}
+
+/*
+** Make the union of two alphabets the alphabet of the automaton
+** and map symbols of both to it (for operations on automata).
+*/
+void merge_alphabets(unsigned *codes_a, unsigned *codes_b)
+{
+    unsigned codes[MAX_CHARS];
+    unsigned ca, cb;
+    int i = 1, j = 1, n = 1;
+
+    codes[0] = 0;
+    map_a[0] = map_b[0] = 0;
+    while (1)
+    {
+        ca = i < MAX_CHARS ? codes_a[i] : 0;
+        cb = j < MAX_CHARS ? codes_b[j] : 0;
+        if (!ca && !cb)
+            break;
+        if (n == MAX_CHARS)
+            error("Too many different characters in the automata.");
+        if (ca && (!cb || ca <= cb))
+        {
+            if (cb == ca)
+                map_b[j++] = n;
+            codes[n] = ca;
+            map_a[i++] = n++;
+        }
+        else
+        {
+            codes[n] = cb;
+            map_b[j++] = n++;
+        }
+    }
+    for (; n < MAX_CHARS; n++)
+        codes[n] = 0;
+    use_alphabet(codes);
+}
+
+/*
+** Mark the code points of an UTF-8 string as used.
+*/
+void mark_code_points(unsigned char *str)
+{
+    unsigned c;
+
+    while (*str)
+    {
+        if ((c = decode_utf8(&str)) == MAX_CODE_POINT)
+            error("Malformed UTF-8 string in the lexicon.");
+        code_used[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+/*
+** Number the marked code points in increasing order.
+*/
+void number_code_points(void)
+{
+    unsigned c;
+
+    alphabet_size = 1;                  /* symbol 0 is not used */
+    for (c = 1; c < MAX_CODE_POINT; c++)
+        if (code_used[c >> 3] & (1 << (c & 7)))
+        {
+            if (alphabet_size == MAX_CHARS)
+                error("Too many different characters in the lexicon.");
+            alphabet[alphabet_size] = c;
+            set_page(symbol_page, c, (unsigned char) alphabet_size++);
+        }
+    for (c = alphabet_size; c < MAX_CHARS; c++)
+        alphabet[c] = 0;
+}
+
+/*
+** Collect code points used in the lexicon and number them
+** in increasing order, so that symbols sort like UTF-8 strings.
+** The first skip bytes of each line are not part of the string.
+*/
+void make_alphabet(size_t skip)
+{
+    unsigned char str[MAX_STR_LEN + 2];
+
+    while (read_string(str))
+        mark_code_points(str + skip);
+    number_code_points();
+
+    rewind_dict();
+    n_strings = 0;
+    n_chars = 0;
+}
+
+/*
+** Replace an UTF-8 string with the string of its symbols.
+** Return the number of symbols.
+*/
+size_t decode_string(unsigned char *str)
+{
+    unsigned char *p = str;
+    size_t i = 0;
+    unsigned s;
+
+    while (*p)
+    {
+        if ((s = NEXT_SYMBOL(p)) == MAX_CHARS)
+            error("Unknown character in the lexicon.");
+        str[i++] = (unsigned char) s;
     }
     str[i] = '\0';
-    n_strings++;
-    n_chars += i + 1;
 
     return i;
 }
+#endif
 /*
 ** Hash function for states.
 */
@@ -266,7 +1082,12 @@ void make_tree(transition *state, int left, int right, unsigned pos, int full)
 ** Seek an identical state in the automaton
 ** or create a new state. Return its index.
 */
+#ifdef USE_VALUES
+unsigned make_state(transition *state, unsigned *state_value,
+                    unsigned state_len)
+#else
 unsigned make_state(transition *state, unsigned state_len)
+#endif
 {
     bucket *ptr;
     int i;
@@ -278,7 +1099,12 @@ unsigned make_state(transition *state, unsigned state_len)
 
     /* make zero state */
     if (state_len == 0)
+    {
+#ifdef USE_VALUES
+        state_value[state_len] = 0;
+#endif
         state[state_len++].all_fields = 0;
+    }
 
 #ifdef USE_TREE
     make_tree(state, 0, state_len - 1, 0, -1);
@@ -288,6 +1114,10 @@ unsigned make_state(transition *state, unsigned state_len)
 
     /* check if an identical state is in automat */
     hash_addr = hash_state(state, state_len);
+#ifdef USE_VALUES
+    for (i = state_len - 1; i >= 0; i--)
+        hash_addr = (hash_addr + state_value[i] * 40503u) % HT_SIZE;
+#endif
     for (ptr = hash_table[hash_addr]; ptr; ptr = ptr->next)
     {
         if (ptr->size == state_len)
@@ -320,6 +1150,10 @@ unsigned make_state(transition *state, unsigned state_len)
                 else if (automat[ptr->addr + i].all_fields != state[i].all_fields)
                     break;
             }
+#elif defined USE_VALUES
+                if (automat[ptr->addr + i].all_fields != state[i].all_fields
+                    || automat_value[ptr->addr + i] != state_value[i])
+                    break;
 #else
                 if (automat[ptr->addr + i].all_fields != state[i].all_fields)
                     break;
@@ -339,42 +1173,38 @@ unsigned make_state(transition *state, unsigned state_len)
 
     /* put state into automat */
 #ifdef USE_INCLUSION
-    if ((pos_in = find_subset(state, state_len)) != -1)
+    pos_in = use_inclusion ? find_subset(state, state_len) : -1;
+    if (pos_in != -1)
         pos_in = reorganize_state(pos_in, state, state_len);
     else
 #endif
     {
         for (i = state_len - 1; i >= 0; i--)
-#ifdef USE_TREE
+#if defined USE_TREE
             automat[aut_size + i] = temp_state[i];
+#elif defined USE_VALUES
+        {
+            automat[aut_size + i] = state[i];
+            automat_value[aut_size + i] = state_value[i];
+        }
 #else
             automat[aut_size + i] = state[i];
 #endif
 #ifdef USE_INCLUSION
         /* add info about state for futher including search */
-        add_state_in(aut_size, aut_size + state_len);
+        if (use_inclusion)
+            add_state_in(aut_size, aut_size + state_len);
 #endif
     }
 
-    if (ht_next_elem >= HT_ELEM_SIZE)
-    {
-        ht_next_elem = 0;
-        if ((ht_elem[++ht_last_pos] =
-            (bucket *) malloc(sizeof(bucket) * HT_ELEM_SIZE)) == NULL)
-            error("Not enough memory.");
-    }
-    ptr = &ht_elem[ht_last_pos][ht_next_elem++];
-
     /* put pointer to the state into hash table */
 #ifdef USE_INCLUSION
     if (pos_in != -1)
-        ptr->addr = pos_in;     /* the state is into another */
+        register_state(hash_addr, pos_in, state_len);  /* the state is into
+                                                          another */
     else
 #endif
-        ptr->addr = aut_size;
-    ptr->size = state_len;
-    ptr->next = hash_table[hash_addr];
-    hash_table[hash_addr] = ptr;
+        register_state(hash_addr, aut_size, state_len);
 
 #ifdef USE_INCLUSION
     if (pos_in != -1)
@@ -393,6 +1223,27 @@ unsigned make_state(transition *state, unsigned state_len)
     return pos;
 }
 
+/*
+** Put a state of given size at addr into the hash table.
+*/
+void register_state(unsigned hash_addr, unsigned addr, unsigned size)
+{
+    bucket *ptr;
+
+    if (ht_next_elem >= HT_ELEM_SIZE)
+    {
+        ht_next_elem = 0;
+        if ((ht_elem[++ht_last_pos] =
+            (bucket *) malloc(sizeof(bucket) * HT_ELEM_SIZE)) == NULL)
+            error("Not enough memory.");
+    }
+    ptr = &ht_elem[ht_last_pos][ht_next_elem++];
+    ptr->addr = addr;
+    ptr->size = size;
+    ptr->next = hash_table[hash_addr];
+    hash_table[hash_addr] = ptr;
+}
+
 #ifdef USE_INCLUSION
 /*
 ** Hash function for including.
@@ -403,79 +1254,62 @@ unsigned hash_fun_in(unsigned p)
 }
 
 /*
-** Put a state into hash_table_in (for including).
+** Take a new entry of hash_table_in.
+*/
+unsigned new_entry_in(void)
+{
+    if ((int) (ht_next_in / HT_ELEM_SIZE) > ht_last_pos_in)
+    {
+        if (ht_last_pos_in + 1 == 2 * MAX_AUT_SIZE / HT_ELEM_SIZE)
+            error("Too many states for including.");
+        if ((ht_elem_in[++ht_last_pos_in] =
+            (in_entry *) malloc(sizeof(in_entry) * HT_ELEM_SIZE)) == NULL)
+            error("Not enough memory.");
+    }
+    return ht_next_in++;
+}
+
+/*
+** Put a state into hash_table_in (for including), once under each
+** of its transitions, with the other states of its size.
 */
 void add_state_in(int first, int last)
 {
+    unsigned *link, e, size = last - first;
     int i;
-    bucket *ptr;
 
     /* states with single transition can't include another */
-    if (last - first == 1)
+    if (size == 1)
         return;
 
     for (i = first; i < last; i++)
     {
         int hash_addr = hash_fun_in(automat[i].d.dest_attr_term);
 
-        if (ht_next_elem_in >= HT_ELEM_SIZE)
+        /* find the head of the size, keeping heads sorted */
+        for (link = &hash_table_in[hash_addr];
+             *link && IN_ENTRY(*link).size < size;
+             link = &IN_ENTRY(*link).next)
+            ;
+        if (*link == 0 || IN_ENTRY(*link).size != size)
         {
-            ht_next_elem_in = 0;
-            if ((ht_elem_in[++ht_last_pos_in] =
-                (bucket *) malloc(sizeof(bucket)*HT_ELEM_SIZE)) == NULL)
-                error("Not enough memory.");
+            e = new_entry_in();
+            IN_ENTRY(e).key = 0;
+            IN_ENTRY(e).size = size;
+            IN_ENTRY(e).next = *link;
+            *link = e;
         }
-        ptr = &ht_elem_in[ht_last_pos_in][ht_next_elem_in++];
 
-        ptr->addr = first;
-        ptr->size = last - first;
-        ptr->next = hash_table_in[hash_addr];
-
-        hash_table_in[hash_addr] = ptr;
+        e = new_entry_in();
+        IN_ENTRY(e).key = automat[i].d.dest_attr_term;
+        IN_ENTRY(e).addr = first;
+        IN_ENTRY(e).size = size;
+        IN_ENTRY(e).next = IN_ENTRY(*link).key;
+        IN_ENTRY(*link).key = e;
         hash_table_in_count[hash_addr]++;
     }
 }
 
-/*
-** Sort a given bucket (natural list mergesort).
-*/
-bucket *mergesort(bucket *p)
-{
-    static bucket head;
-    bucket *r = &head, *pp, *pn;
-
-    for (pp = p, pn = pp->next; pn; pp = pn, pn = pn->next)
-    {
-        if (pp->size > pn->size)
-        {
-            r->next = pn;
-            r = pp;
-        }
-    }
-    if (r == &head)
-        return p;
-    r->next = NULL;
-    pp = mergesort(head.next);
-    pn = mergesort(p);
-
-    r = &head;
-    while (pp && pn)
-    {
-        if (pp->size < pn->size)
-        {
-            r = r->next = pp;
-            pp = pp->next;
-        }
-        else
-        {
-            r = r->next = pn;
-            pn = pn->next;
-        }
-    }
-    r->next = pp ? pp : pn;
-    return head.next;
-}
-
 /*
 ** Find a state that subsumes current one.
 */
@@ -483,58 +1317,54 @@ int find_subset(transition *state, unsigned state_len)
 {
     int i, p, lp;
     int pos;
-    int lpos = 0;
     int hash_addr;
-    bucket *e;
+    unsigned head, e, key;
 
     /* choose the bucket conitaining the fewest states */
-    int best_hash, best_count = INT_MAX;
+    int best_hash = 0, best_key = 0;
+    unsigned best_count = UINT_MAX;
     for (i = state_len - 1; i >= 0; i--)
     {
         hash_addr = hash_fun_in(state[i].d.dest_attr_term);
         if (hash_table_in_count[hash_addr] <= best_count)
         {
             best_hash = hash_addr;
+            best_key = i;
             best_count = hash_table_in_count[hash_addr];
         }
     }
-    hash_addr = best_hash;
-
-    pos = lpos;
+    key = state[best_key].d.dest_attr_term;
 
     /* we try to select the smallest state that can include
-    the current state, so the chosen list should be sorted */
-    if (hash_table_in_count[hash_addr] > 1)
-        hash_table_in[hash_addr] = mergesort(hash_table_in[hash_addr]);
-    e = hash_table_in[hash_addr];
-
-    while (e)
+    the current state, so sizes are tried in increasing order */
+    for (head = hash_table_in[best_hash]; head; head = IN_ENTRY(head).next)
     {
-        /* smaller states shouldn't be tested */
-        if (e->size >= state_len)
+        /* smaller states shouldn't be tested, and an including state
+        of the same size would be identical, so make_state found it */
+        if (IN_ENTRY(head).size <= state_len)
+            continue;
+        for (e = IN_ENTRY(head).key; e; e = IN_ENTRY(e).next)
         {
-            p = e->addr;
-            lpos = pos;
-            lp = p;
+            /* only states with the transition itself can include */
+            if (IN_ENTRY(e).key != key)
+                continue;
+            p = lp = IN_ENTRY(e).addr;
             /* when the state is reorganized we can't do it one more time */
-            if (!frozen_states[p])
-            {
-                do
-                { /* check the current state */
-                    if (automat[p].d.dest_attr_term ==
-                        state[pos].d.dest_attr_term)
-                    {
-                        if (state[pos].b.last)
-                            return lp;
-                        pos++;
-                    }
-                    else if (automat[p].b.attr > state[pos].b.attr)
-                        break;
-                } while (!automat[p++].b.last);
-            }
-            pos = lpos;
+            if (frozen_states[p])
+                continue;
+            pos = 0;
+            do
+            { /* check the current state */
+                if (automat[p].d.dest_attr_term == state[pos].d.dest_attr_term)
+                {
+                    if (state[pos].b.last)
+                        return lp;
+                    pos++;
+                }
+                else if (automat[p].b.attr > state[pos].b.attr)
+                    break;
+            } while (!automat[p++].b.last);
         }
-        e = e->next;
     }
 
     return -1;
@@ -591,294 +1421,4565 @@ int reorganize_state(unsigned pos, transition *state, unsigned state_len)
 #endif
 
 /*
-** Create the automaton.
+** Prepare the builder for a new automaton.
 */
-void make_automat(void)
+void start_automat(void)
 {
-    unsigned char s0[MAX_STR_LEN + 1] = "";
-    unsigned char s1[MAX_STR_LEN + 1];
-    size_t i = 0, p, q;
-    transition new_trans;
+    prepare_tables();   /* prepare data structures for algorithm */
+    last_len = 0;
+    last_str[0] = '\0';
+}
 
-#ifndef USE_TREE
-    new_trans.b.last = 0;
-#else
-    new_trans.b.llast = 0;
-    new_trans.b.rlast = 0;
+/*
+** Add a string to the automaton. Strings must come in increasing
+** order; p is the length of the common prefix of str and the string
+** added before it. With USE_VALUES the string gets str_value.
+*/
+void add_string(unsigned char *str, size_t q, size_t p)
+{
+    size_t i = last_len;
+    transition new_trans;
+#ifdef USE_VALUES
+    size_t j;
 #endif
-    prepare_tables();   /* prepare data structures for algorithm */
 
-    while ((q = read_string(s1)) != 0)
-    {
-        /* find common prefix */
-        for (p = 0; s1[p] == s0[p]; p++)
-            ;
-        if (s1[p] < s0[p])
-            error("Strings in the lexicon file are unsorted.");
+    new_trans.all_fields = 0;
 
-        /* emit states for suffix of previous string */
-        while (i > p)
-        {
-            new_trans.b.dest = make_state(larval_state[i], l_state_len[i]);
-            new_trans.b.attr = s0[--i];
-            new_trans.b.term = is_terminal[i + 1];
-            larval_state[i][l_state_len[i]++].all_fields = new_trans.all_fields;
-        }
+    /* emit states for suffix of previous string */
+    while (i > p)
+    {
+#ifdef USE_VALUES
+        new_trans.b.dest = make_state(larval_state[i], larval_value[i],
+                                      l_state_len[i]);
+#else
+        new_trans.b.dest = make_state(larval_state[i], l_state_len[i]);
+#endif
+        new_trans.b.attr = last_str[--i];
+        new_trans.b.term = is_terminal[i + 1];
+#ifdef USE_VALUES
+        larval_value[i][l_state_len[i]] = last_value[i];
+#endif
+        larval_state[i][l_state_len[i]++].all_fields = new_trans.all_fields;
+    }
 
-        /* copy suffix of s1 to s0 */
-        while (i < q)
-        {
-            s0[i] = s1[i];
-            is_terminal[++i] = 0;
-            l_state_len[i] = 0;
-        }
-        s0[q] = '\0';
-        is_terminal[q] = 1;
+#ifdef USE_VALUES
+    /* the output of a transition makes up the value of the first */
+    /* string through it, so only the new branch gets a non-zero one */
+    last_value[p] = str_value;
+    for (j = 0; j < p; j++)
+        last_value[p] -= last_value[j];
+#endif
 
-#ifdef PRINT_STATISTICS
-        if (n_strings % 65536 == 0)
-            printf("%lu strings read\t%u transitions created\n", n_strings, aut_size);
+    /* copy suffix of str to last_str */
+    while (i < q)
+    {
+        last_str[i] = str[i];
+        is_terminal[++i] = 0;
+        l_state_len[i] = 0;
+#ifdef USE_VALUES
+        last_value[i] = 0;
 #endif
     }
+    last_str[q] = '\0';
+    last_len = q;
+    is_terminal[q] = 1;
+}
+
+/*
+** Emit the remaining states and finish the automaton.
+*/
+void finish_automat(void)
+{
+    size_t i = last_len;
+    transition new_trans;
+
+    new_trans.all_fields = 0;
     while (i > 0)
     {
+#ifdef USE_VALUES
+        new_trans.b.dest = make_state(larval_state[i], larval_value[i],
+                                      l_state_len[i]);
+#else
         new_trans.b.dest = make_state(larval_state[i], l_state_len[i]);
+#endif
         new_trans.b.term = is_terminal[i];
-        new_trans.b.attr = s0[--i];
+        new_trans.b.attr = last_str[--i];
+#ifdef USE_VALUES
+        larval_value[i][l_state_len[i]] = last_value[i];
+#endif
         larval_state[i][l_state_len[i]++].all_fields = new_trans.all_fields;
     }
+    last_len = 0;
+#ifdef USE_VALUES
+    start_state = make_state(larval_state[0], larval_value[0], l_state_len[0]);
+#else
     start_state = make_state(larval_state[0], l_state_len[0]);
+#endif
     automat[aut_size].b.dest = start_state;   /* put pseudo state */
 }
 
 /*
-** Check if the given string exists in the automaton.
+** Create the automaton.
 */
-int check_string(unsigned char *str)
+void make_automat(void)
 {
-    unsigned pos = 0;
-    int i;
-    unsigned char w;
+    unsigned char *text;
+    size_t size;
 
-#ifdef USE_TREE
-    int found;
-    int offset;
-    transition e;
+#ifdef USE_UTF8
+    make_alphabet(0);   /* number the code points of the lexicon */
+#endif
+    start_automat();
+    if (!front_coded && (text = map_file(lex_file, &size)) != NULL)
+    {
+        add_mapped_lexicon(text, size);
+        unmap_file(text, size);
+    }
+    else
+        add_lexicon();  /* pipes, empty and front-coded files */
+    finish_automat();
+}
 
-    pos = automat[pos].b.dest;
+/*
+** Add the strings of the lexicon file to the automaton.
+*/
+void add_lexicon(void)
+{
+    unsigned char s1[MAX_STR_LEN + 1];
+    size_t p, q;
 
-    for (i = 0; str[i]; i++)
+    while ((q = read_string(s1)) != 0)
     {
-        if (pos > aut_size)
-            error("Error in automaton file.");
-        found = 0;
-        w = str[i];
-        offset = 1;
-
-        /* search the tree for current character */
-        while (1)
+#ifdef USE_UTF8
+        n_symbols += q = decode_string(s1);
+#endif
+        /* find common prefix */
+#ifndef USE_UTF8
+        if (front_coded)
         {
-            e = automat[pos + offset - 1];
-            if (e.b.attr == w)
-            {
-                found = 1;
-                break;
-            }
-            if (e.b.attr > w)
-            {
-                if (e.b.llast)
-                    break;
-                offset = offset * 2;
-            }
-            else
-            {
-                if (e.b.rlast)
-                    break;
-                offset = offset * 2 + 1;
-            }
+            p = coded_prefix;   /* given by the file */
+            if (p < q && p < last_len && s1[p] == last_str[p])
+                error("Malformed front-coded lexicon.");
         }
-        if (!found)
-            return 0;
-        if (str[i + 1])          /* if not last character in string */
-            pos = e.b.dest;    /* get index of new state */
-    }
-    return e.b.term;
-#else
-    for (i = 0; str[i]; i++)
-    {
-        /* get pointer to new state */
-        pos = automat[pos].b.dest;
-        w = str[i];
+        else
+#endif
+            p = common_prefix(s1, last_str, q < last_len ? q : last_len);
+        if (p == q ? q < last_len : s1[p] < last_str[p])
+            error("Strings in the lexicon file are unsorted.");
+        if (p == q && q == last_len)
+            continue;           /* repeated string */
 
-        if (!pos)
-            return 0;
+        add_string(s1, q, p);
 
-        if (pos > aut_size)
-            error("Error in automaton file.");
-        /* find current character in state */
-        while (automat[pos].b.attr != (unsigned) w)
-        {
-            if (automat[pos++].b.last)
-                return 0;
-            if (pos > aut_size)
-                error("Error in automaton file.");
-        }
-    }
-    return automat[pos].b.term;
+#ifdef PRINT_STATISTICS
+        if (n_strings % 65536 == 0)
+            printf("%lu strings read\t%u transitions created\n", n_strings, aut_size);
 #endif
+    }
 }
 
 /*
-** Check if the automaton is correct
-** (test all the strings from a lexicon).
+** Add the strings of a lexicon mapped into memory to the automaton.
+** Lines are found with memchr and passed to the builder in place;
+** only USE_UTF8 copies them, to turn code points into symbols.
+** Lines with an empty string are skipped, as read_string does.
 */
-void test_automat(void)
+void add_mapped_lexicon(unsigned char *text, size_t size)
 {
-    n_strings = 0;
-    n_chars = 0;
-
-    while (read_string(temp_str))
-        if (!check_string(temp_str))
-            printf("String %s not found!\n", temp_str);
-}
+    unsigned char *str, *end, *text_end = text + size;
+#ifdef USE_UTF8
+    unsigned char s1[MAX_STR_LEN + 1];
+#endif
+    size_t len, p, q;
 
-/*
-** Recursively list all the strings recognized by an automaton,
-** beginning at the given position in the automaton and in the
-** string.
-*/
-#ifdef USE_TREE
-void list_strings(unsigned pos, int str_pos, int tree_pos)
+    for (; text < text_end; text = end + 1)
+    {
+        if ((end = (unsigned char *) memchr(text, '\n', text_end - text)) == NULL)
+            end = text_end;     /* the last line has no line end */
+        if ((len = end - text) > MAX_STR_LEN)
+            error("Lexicon string too long.");
+#ifdef USE_VALUES
+        q = span_value(text, len, &str_value);
 #else
-void list_strings(unsigned pos, int str_pos)
+        q = len;
 #endif
-{
-    int i;
+        if (q == 0)
+            continue;
+        n_strings++;
+        n_chars += len + 1;
+#ifdef USE_UTF8
+        memcpy(s1, text, q);
+        s1[q] = '\0';
+        n_symbols += q = decode_string(str = s1);
+#else
+        str = text;
+#endif
+        /* find common prefix */
+        p = common_prefix(str, last_str, q < last_len ? q : last_len);
+        if (p == q ? q < last_len : str[p] < last_str[p])
+            error("Strings in the lexicon file are unsorted.");
+        if (p == q && q == last_len)
+            continue;           /* repeated string */
 
-    if (pos == 0)
-        return;
+        add_string(str, q, p);
 
-    if (pos > aut_size)
-        error("Error in automat file.");
+#ifdef PRINT_STATISTICS
+        if (n_strings % 65536 == 0)
+            printf("%lu strings read\t%u transitions created\n", n_strings, aut_size);
+#endif
+    }
+}
 
-#ifdef USE_TREE
-    /* go left */
-    if (!automat[pos + tree_pos].b.llast)
-        list_strings(pos, str_pos, tree_pos + tree_pos + 1);
+ring_entry ring[RING_SIZE];          /* words passed to the builder (-b) */
+volatile unsigned long ring_head;   /* next word to build */
+volatile unsigned long ring_tail;   /* next word to read */
+unsigned char *pipe_text;           /* mapped lexicon or NULL */
+size_t pipe_size;
 
-    /* add new character */
-    temp_str[str_pos] = (unsigned char) (automat[pos + tree_pos].b.attr);
-    if (automat[pos + tree_pos].b.term)
-    {
-        /* when string terminates at this character write the string */
-        for (i = 0; i <= str_pos; i++)
-            putc(temp_str[i], lex_file);
-        putc('\n', lex_file);
-        n_strings++;
-        n_chars += str_pos + 2;
-    }
-    /* execute recursively for all characters in current state */
-    list_strings(automat[pos + tree_pos].b.dest, str_pos + 1, 0);
+/*
+** Read the lexicon, prepare its strings and pass them to the builder
+** through the ring. Only this thread moves ring_tail; the entry
+** before ring_tail stays unchanged, so it serves as the last string.
+*/
+THREAD_FUN(pipe_reader)
+{
+    unsigned char *text = pipe_text, *end, *text_end = pipe_text + pipe_size;
+    ring_entry *e, *last = NULL;
+    size_t len, q;
 
-    /* go right */
-    if (!automat[pos + tree_pos].b.rlast)
-        list_strings(pos, str_pos, tree_pos + tree_pos + 2);
-#else
-    do
+    (void) arg;
+    for (;;)
     {
-        temp_str[str_pos] = (unsigned char) (automat[pos].b.attr);
-        if (automat[pos].b.term)
+        while (ring_tail - ring_head == RING_SIZE)
+            YIELD();            /* the builder is behind */
+        e = &ring[ring_tail % RING_SIZE];
+
+        /* take the next line */
+        if (text != NULL)
         {
-            /* when string terminates at this character write the string */
-            for (i = 0; i <= str_pos; i++)
-                putc(temp_str[i], lex_file);
-            putc('\n', lex_file);
-            n_strings++;
-            n_chars += str_pos + 2;
+            if (text >= text_end)
+                break;
+            if ((end = (unsigned char *) memchr(text, '\n',
+                                                text_end - text)) == NULL)
+                end = text_end;
+            if ((len = end - text) > MAX_STR_LEN)
+                error("Lexicon string too long.");
+            memcpy(e->str, text, len);
+            text = end + 1;
+        }
+        else
+        {
+            if (fgets((char *) e->str, MAX_STR_LEN + 2, lex_file) == NULL)
+                break;
+            if ((len = strlen((char *) e->str)) > 0 && e->str[len - 1] == '\n')
+                len--;
+            else if (len > MAX_STR_LEN)
+                error("Lexicon string too long.");
         }
-        /* execute recursively for all characters in current state */
-        list_strings(automat[pos].b.dest, str_pos + 1);
-    } while (!(automat[pos++].b.last));
+#ifdef USE_VALUES
+        q = span_value(e->str, len, &e->value);
+#else
+        q = len;
+#endif
+        if (q == 0)
+            continue;           /* as read_string does */
+        n_strings++;
+        n_chars += len + 1;
+        e->str[q] = '\0';
+#ifdef USE_UTF8
+        n_symbols += q = decode_string(e->str);
 #endif
+        if (last == NULL)
+            e->prefix = 0;
+        else
+        {
+            e->prefix = common_prefix(e->str, last->str,
+                                      q < last->len ? q : last->len);
+            if (e->prefix == q ? q < last->len
+                               : e->str[e->prefix] < last->str[e->prefix])
+                error("Strings in the lexicon file are unsorted.");
+            if (e->prefix == q && q == last->len)
+                continue;       /* repeated string */
+        }
+        e->len = q;
+
+        MEMORY_BARRIER();       /* publish the entry before the index */
+        ring_tail++;
+        last = e;
+    }
+
+    while (ring_tail - ring_head == RING_SIZE)
+        YIELD();
+    ring[ring_tail % RING_SIZE].len = 0;
+    MEMORY_BARRIER();
+    ring_tail++;
+    return 0;
 }
 
 /*
-** Show some statistics, including execution time.
+** Create the automaton in two threads: pipe_reader reads, splits,
+** decodes and compares the strings, while this one only builds states.
 */
-void show_stat(double exec_time)
+void make_automat_pipelined(void)
 {
-    printf("%lu strings\t%lu characters\n", n_strings, n_chars);
+    thread_t reader;
+    ring_entry *e;
 #ifdef PRINT_STATISTICS
-    printf("%u states\t%u transitions\t%u terminal transitions\n",
-           n_states, n_trans, n_term_trans);
-#ifdef USE_INCLUSION
-    printf("%u included states\t%u included transitions\n",
-           n_states_in, n_trans_in);
+    unsigned long n = 0;
 #endif
+
+#ifdef USE_UTF8
+    make_alphabet(0);   /* number the code points of the lexicon */
 #endif
-    printf("Execution time: %.3f seconds\t", exec_time);
-    if (exec_time != 0.0)
+    pipe_text = map_file(lex_file, &pipe_size);
+    ring_head = ring_tail = 0;
+    start_thread(&reader, pipe_reader, NULL);
+
+    start_automat();
+    for (;;)
     {
-        printf("\nExecution speed: %.lf wps, %.lf cps\n",
-               n_strings / exec_time, n_chars / exec_time);
+        while (ring_head == ring_tail)
+            YIELD();            /* the reader is behind */
+        MEMORY_BARRIER();
+        e = &ring[ring_head % RING_SIZE];
+        if (e->len == 0)
+            break;
+#ifdef USE_VALUES
+        str_value = e->value;
+#endif
+        add_string(e->str, e->len, e->prefix);
+        MEMORY_BARRIER();       /* finish with the entry before freeing it */
+        ring_head++;
+
+#ifdef PRINT_STATISTICS
+        if (++n % 65536 == 0)
+            printf("%lu strings built\t%u transitions created\n", n, aut_size);
+#endif
+    }
+    finish_automat();
+
+    join_thread(reader);
+    if (pipe_text != NULL)
+        unmap_file(pipe_text, pipe_size);
+}
+
+/*
+** Return the length of the common prefix of a and b, which are
+** at least n bytes long, comparing them a machine word at a time.
+*/
+size_t common_prefix(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i = 0, wa, wb;
+
+    for (; i + sizeof wa <= n; i += sizeof wa)
+    {
+        memcpy(&wa, a + i, sizeof wa);
+        memcpy(&wb, b + i, sizeof wb);
+        if (wa != wb)
+            break;
+    }
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/*
+** Sort strings that are equal up to depth by insertion.
+*/
+void insertion_sort(unsigned char **a, size_t n, size_t depth)
+{
+    unsigned char *s;
+    size_t i, j;
+
+    for (i = 1; i < n; i++)
+    {
+        s = a[i];
+        for (j = i; j > 0 && strcmp((char *) a[j - 1] + depth,
+                                    (char *) s + depth) > 0; j--)
+            a[j] = a[j - 1];
+        a[j] = s;
+    }
+}
+
+/*
+** Sort strings that are equal up to depth in byte order (the order
+** of make_automat) with MSD radix sort. tmp has room for n strings.
+*/
+void radix_sort(unsigned char **a, size_t n, size_t depth,
+                unsigned char **tmp)
+{
+    unsigned count[MAX_CHARS];
+    unsigned c, pos, next;
+    size_t i;
+
+    if (n < RADIX_CUTOFF)
+    {
+        insertion_sort(a, n, depth);
+        return;
+    }
+
+    /* distribute by the byte at depth; 0 ends the string */
+    memset(count, 0, sizeof count);
+    for (i = 0; i < n; i++)
+        count[a[i][depth]]++;
+    for (pos = 0, c = 0; c < MAX_CHARS; c++)
+    {
+        next = pos + count[c];
+        count[c] = pos;
+        pos = next;
+    }
+    for (i = 0; i < n; i++)
+        tmp[count[a[i][depth]]++] = a[i];
+    memcpy(a, tmp, n * sizeof *a);
+
+    /* count[c] is now the end of bucket c; strings in bucket 0 are equal */
+    for (pos = count[0], c = 1; c < MAX_CHARS; pos = count[c++])
+        if (count[c] - pos > 1)
+            radix_sort(a + pos, count[c] - pos, depth + 1, tmp + pos);
+}
+
+unsigned char **sort_base;          /* strings being sorted */
+unsigned char **sort_tmp;           /* room for sorting */
+sort_task *sort_tasks;              /* buckets left to the workers */
+unsigned sort_n_tasks, sort_max_tasks;
+unsigned sort_split;                /* larger buckets are split further */
+volatile long sort_next_task;
+
+/*
+** Distribute the strings of a bucket by the byte at depth until the
+** parts are small enough to be sorted by one worker, so that a few
+** frequent prefixes do not leave all the work to a single thread.
+*/
+void split_bucket(unsigned begin, unsigned len, unsigned depth)
+{
+    unsigned count[MAX_CHARS];
+    unsigned char **a = sort_base + begin;
+    unsigned c, pos, next, i;
+
+    if (len <= sort_split)
+    {
+        if (sort_n_tasks == sort_max_tasks
+            && (sort_tasks = (sort_task *) realloc(sort_tasks,
+                  (sort_max_tasks *= 2) * sizeof *sort_tasks)) == NULL)
+            error("Not enough memory.");
+        sort_tasks[sort_n_tasks].begin = begin;
+        sort_tasks[sort_n_tasks].len = len;
+        sort_tasks[sort_n_tasks++].depth = depth;
+        return;
+    }
+
+    memset(count, 0, sizeof count);
+    for (i = 0; i < len; i++)
+        count[a[i][depth]]++;
+    for (pos = 0, c = 0; c < MAX_CHARS; c++)
+    {
+        next = pos + count[c];
+        count[c] = pos;
+        pos = next;
+    }
+    for (i = 0; i < len; i++)
+        sort_tmp[begin + count[a[i][depth]]++] = a[i];
+    memcpy(a, sort_tmp + begin, len * sizeof *a);
+
+    /* strings in bucket 0 are equal */
+    for (pos = count[0], c = 1; c < MAX_CHARS; pos = count[c++])
+        if (count[c] - pos > 1)
+            split_bucket(begin + pos, count[c] - pos, depth + 1);
+}
+
+/*
+** Take the buckets left by split_bucket one by one and sort them.
+*/
+THREAD_FUN(sort_worker)
+{
+    sort_task *task;
+    long i;
+
+    (void) arg;
+    while ((i = ATOMIC_NEXT(&sort_next_task)) < (long) sort_n_tasks)
+    {
+        task = &sort_tasks[i];
+        radix_sort(sort_base + task->begin, task->len, task->depth,
+                   sort_tmp + task->begin);
+    }
+    return 0;
+}
+
+/*
+** Sort n strings in byte order using all processors: large buckets
+** are distributed here, the small ones are sorted in parallel.
+*/
+void sort_lexicon(unsigned char **a, size_t n)
+{
+    thread_t threads[MAX_THREADS];
+    int n_threads, j;
+
+    if (n > UINT_MAX)
+        error("Too many strings in the lexicon.");
+    if ((sort_tmp = (unsigned char **) malloc((n + 1) * sizeof *a)) == NULL
+        || (sort_tasks = (sort_task *) malloc((sort_max_tasks = MAX_CHARS)
+                                              * sizeof *sort_tasks)) == NULL)
+        error("Not enough memory.");
+    sort_base = a;
+
+    n_threads = count_cpus();
+    sort_split = (unsigned) (n / (SORT_TASKS * n_threads));
+    if (sort_split < RADIX_CUTOFF)
+        sort_split = RADIX_CUTOFF;
+    sort_n_tasks = 0;
+    if (n > 1)
+        split_bucket(0, (unsigned) n, 0);
+
+    sort_next_task = 0;
+    for (j = 0; j < n_threads; j++)
+        start_thread(&threads[j], sort_worker, NULL);
+    for (j = 0; j < n_threads; j++)
+        join_thread(threads[j]);
+    free(sort_tasks);
+    free(sort_tmp);
+}
+
+#ifdef USE_VALUES
+unsigned char *line_text;           /* text cut by cut_lines */
+#endif
+
+/*
+** Cut text into strings at line ends and return the non-empty
+** ones in a new array; their number goes to n. With USE_VALUES
+** the strings are cut off their values, so that only they are
+** compared, and the value is kept before the string (see line_value).
+*/
+unsigned char **cut_lines(unsigned char *text, size_t size, size_t *n)
+{
+    unsigned char **lines, *line;
+    size_t i, len;
+#ifdef USE_VALUES
+    size_t q, j;
+    unsigned value;
+
+    line_text = text;
+#endif
+
+    for (*n = 0, i = 0; i < size; i++)
+        *n += text[i] == '\n';
+    if ((lines = (unsigned char **) malloc((*n + 1) * sizeof *lines)) == NULL)
+        error("Not enough memory.");
+    for (*n = 0, line = text, i = 0; i < size; i++)
+        if (text[i] == '\n')
+        {
+            text[i] = '\0';
+            if ((len = text + i - line) > MAX_STR_LEN)
+                error("Lexicon string too long.");
+            /* lines with an empty string are skipped */
+#ifdef USE_VALUES
+            if ((q = span_value(line, len, &value)) != 0)
+            {
+                if (q < len)
+                { /* "string\tvalue" becomes "digits\tstring" */
+                    memmove(line + len - q, line, q);
+                    line[j = len - q - 1] = '\t';
+                    for (; j > 0; value /= 10)
+                        line[--j] = value ? (unsigned char) ('0' + value % 10)
+                                          : '\0';
+                }
+                lines[(*n)++] = line + len - q;
+#else
+            if (len != 0)
+            {
+                lines[(*n)++] = line;
+#endif
+                n_strings++;
+                n_chars += len + 1;
+            }
+            line = text + i + 1;
+        }
+    return lines;
+}
+
+#ifdef USE_VALUES
+/*
+** Return the value of a string cut by cut_lines: the digits before
+** the tab preceding it, or 0 if there is no tab.
+*/
+unsigned line_value(const unsigned char *str)
+{
+    unsigned value = 0, scale = 1;
+
+    if (str == line_text || str[-1] != '\t')
+        return 0;
+    for (str--; str > line_text && str[-1] >= '0' && str[-1] <= '9';
+         scale *= 10)
+        value += (*--str - '0') * scale;
+    return value;
+}
+#endif
+
+/*
+** Sort n strings, drop repeated ones and return how many are left.
+** The sort keeps equal strings in their order, so the first one
+** of each is kept.
+*/
+size_t sort_unique(unsigned char **lines, size_t n)
+{
+    size_t i, j;
+
+    sort_lexicon(lines, n);
+    for (i = j = 0; i < n; i++)
+        if (!j || strcmp((char *) lines[j - 1], (char *) lines[i]))
+            lines[j++] = lines[i];
+    return j;
+}
+
+#ifdef USE_UTF8
+/*
+** Mark the code points of n strings.
+*/
+void mark_lines(unsigned char **lines, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        mark_code_points(lines[i]);
+}
+#endif
+
+/*
+** Add a string of a sorted stream to the automaton (with the value
+** str_value), skipping it if it repeats the last one.
+*/
+void add_sorted_string(unsigned char *str)
+{
+    unsigned char s1[MAX_STR_LEN + 1];
+    size_t p, q;
+
+    strcpy((char *) s1, (char *) str);
+    q = strlen((char *) s1);
+#ifdef USE_UTF8
+    n_symbols += q = decode_string(s1);
+#endif
+    p = common_prefix(s1, last_str, q < last_len ? q : last_len);
+    if (p == q ? q < last_len : s1[p] < last_str[p])
+        error("Sorted strings are out of order.");
+    if (p == q && q == last_len)
+        return;                 /* the first value of a string is kept */
+    add_string(s1, q, p);
+}
+
+/*
+** Create the automaton from an unsorted lexicon: read it whole
+** into memory, sort it, drop repeated strings and feed the rest
+** to the builder, as make_automat does with a sorted file. A string
+** repeated with other values keeps the value of its first line.
+*/
+void make_automat_unsorted(void)
+{
+    unsigned char *text, **lines;
+    size_t size = 0, alloc = LIST_BUF_SIZE, n, i, len;
+
+    /* read the whole lexicon */
+    if ((text = (unsigned char *) malloc(alloc)) == NULL)
+        error("Not enough memory.");
+    while ((len = fread(text + size, 1, alloc - size - 1, lex_file)) > 0)
+        if ((size += len) + 1 == alloc
+            && (text = (unsigned char *) realloc(text, alloc *= 2)) == NULL)
+            error("Not enough memory.");
+    if (size && text[size - 1] != '\n')
+        text[size++] = '\n';
+
+    lines = cut_lines(text, size, &n);
+    n = sort_unique(lines, n);
+#ifdef USE_UTF8
+    mark_lines(lines, n);
+    number_code_points();   /* number the code points of the lexicon */
+#endif
+
+    start_automat();
+    for (i = 0; i < n; i++)
+    {
+#ifdef USE_VALUES
+        str_value = line_value(lines[i]);
+#endif
+        add_sorted_string(lines[i]);
+    }
+    finish_automat();
+
+    free(lines);
+    free(text);
+}
+
+FILE *run_file[MAX_RUNS];           /* sorted runs on disk (-x) */
+unsigned char run_str[MAX_RUNS][MAX_STR_LEN + 14];  /* head of each run */
+int run_heap[MAX_RUNS];             /* runs ordered by their heads */
+#ifdef USE_VALUES
+unsigned run_value[MAX_RUNS];       /* value of each head */
+#endif
+int n_runs;                         /* older runs come first */
+FILE *level_file[MAX_LEVELS][MAX_RUNS]; /* runs waiting at each level; */
+int level_runs[MAX_LEVELS];         /* a run of level l merges MAX_RUNS^l */
+int total_runs;
+
+/*
+** Read the next string of run r into run_str[r] (and its value into
+** run_value[r]); return 0 at its end.
+*/
+int read_run(int r)
+{
+    size_t len;
+
+    if (fgets((char *) run_str[r], sizeof run_str[r], run_file[r]) == NULL)
+    {
+        if (ferror(run_file[r]))
+            error("Cannot read a run file.");
+        return 0;
+    }
+    len = strlen((char *) run_str[r]) - 1;  /* strip the line end */
+#ifdef USE_VALUES
+    len = span_value(run_str[r], len, &run_value[r]);
+#endif
+    run_str[r][len] = '\0';
+    return 1;
+}
+
+/*
+** Check if the head of run a goes before the head of run b. Of equal
+** strings, the one of the older run goes first.
+*/
+int run_before(int a, int b)
+{
+    int c = strcmp((char *) run_str[a], (char *) run_str[b]);
+
+    return c < 0 || (c == 0 && a < b);
+}
+
+/*
+** Move the run at position i of the heap of n runs down to its place.
+*/
+void sift_run(int i, int n)
+{
+    int r = run_heap[i], c;
+
+    while ((c = 2 * i + 1) < n)
+    {
+        if (c + 1 < n && run_before(run_heap[c + 1], run_heap[c]))
+            c++;
+        if (!run_before(run_heap[c], r))
+            break;
+        run_heap[i] = run_heap[c];
+        i = c;
+    }
+    run_heap[i] = r;
+}
+
+/*
+** Merge all runs into the file out, or into the automaton
+** if out is NULL, dropping repeated strings, of which the one
+** from the oldest run is kept. The runs are closed.
+*/
+void merge_runs(FILE *out)
+{
+    unsigned char last[MAX_STR_LEN + 2];
+    int i, n, r;
+
+    for (n = i = 0; i < n_runs; i++)
+        if (read_run(i))
+            run_heap[n++] = i;
+        else
+            fclose(run_file[i]);
+    for (i = n / 2; i-- > 0; )
+        sift_run(i, n);
+
+    last[0] = '\0';             /* runs hold no empty strings */
+    while (n > 0)
+    {
+        r = run_heap[0];
+#ifdef USE_VALUES
+        str_value = run_value[r];
+#endif
+        if (out == NULL)
+            add_sorted_string(run_str[r]);
+        else if (strcmp((char *) last, (char *) run_str[r]))
+        {
+            fputs((char *) run_str[r], out);
+#ifdef USE_VALUES
+            fprintf(out, "\t%u", str_value);
+#endif
+            putc('\n', out);
+            strcpy((char *) last, (char *) run_str[r]);
+        }
+        if (!read_run(r))
+        {
+            fclose(run_file[r]);
+            run_heap[0] = run_heap[--n];
+        }
+        sift_run(0, n);
+    }
+    n_runs = 0;
+}
+
+/*
+** Merge the runs of a level into a new run and return it.
+*/
+FILE *merge_level(int level)
+{
+    FILE *f;
+
+    n_runs = level_runs[level];
+    memcpy(run_file, level_file[level], n_runs * sizeof *run_file);
+    total_runs -= n_runs;
+    level_runs[level] = 0;
+    if (n_runs == 1)            /* nothing to merge it with */
+        return run_file[0];
+    if ((f = tmpfile()) == NULL)
+        error("Cannot create a run file.");
+    merge_runs(f);
+    if (fflush(f) != 0 || ferror(f))
+        error("Cannot write a run file.");
+    rewind(f);
+    return f;
+}
+
+/*
+** Put the run f at a level. When the level is full, its runs are
+** merged into one run of the next level, so each string is copied
+** once per level rather than once per run written after it.
+*/
+void add_run(FILE *f, int level)
+{
+    if (level == MAX_LEVELS)
+        error("Too many run files.");
+    level_file[level][level_runs[level]++] = f;
+    total_runs++;
+    if (level_runs[level] == MAX_RUNS)
+        add_run(merge_level(level), level + 1);
+}
+
+/*
+** Sort n strings and write them without repetitions to a new run.
+*/
+void write_run(unsigned char **lines, size_t n)
+{
+    FILE *f;
+    size_t i;
+
+    n = sort_unique(lines, n);
+#ifdef USE_UTF8
+    mark_lines(lines, n);
+#endif
+    if ((f = tmpfile()) == NULL)
+        error("Cannot create a run file.");
+    for (i = 0; i < n; i++)
+    {
+        fputs((char *) lines[i], f);
+#ifdef USE_VALUES
+        fprintf(f, "\t%u", line_value(lines[i]));
+#endif
+        putc('\n', f);
+    }
+    if (fflush(f) != 0 || ferror(f))
+        error("Cannot write a run file.");
+    rewind(f);
+    add_run(f, 0);
+
+#ifdef PRINT_STATISTICS
+    printf("%lu strings read\t%d runs on disk\n", n_strings, total_runs);
+#endif
+}
+
+/*
+** Create the automaton from an unsorted lexicon of any size:
+** cut it into pieces of RUN_SIZE bytes, write each piece sorted
+** to a temporary file, merge the files by levels of MAX_RUNS and
+** the last ones straight into the builder.
+*/
+void make_automat_external(void)
+{
+    unsigned char *text, **lines;
+    size_t size, end, n;
+    int at_end, level;
+
+    if ((text = (unsigned char *) malloc(RUN_SIZE + 1)) == NULL)
+        error("Not enough memory.");
+    for (size = end = 0; ; )
+    {
+        /* keep the unfinished line of the previous piece */
+        memmove(text, text + end, size -= end);
+        size += fread(text + size, 1, RUN_SIZE - size, lex_file);
+        if (ferror(lex_file))
+            error("Cannot read the lexicon file.");
+        if ((at_end = size < RUN_SIZE) != 0 && size && text[size - 1] != '\n')
+            text[size++] = '\n';
+        for (end = size; end > 0 && text[end - 1] != '\n'; end--)
+            ;
+        if (end == 0 && size > 0)
+            error("Lexicon string too long.");
+
+        lines = cut_lines(text, end, &n);
+        if (n)
+            write_run(lines, n);
+        free(lines);
+        if (at_end)
+            break;
+    }
+    free(text);
+
+#ifdef USE_UTF8
+    number_code_points();   /* number the code points of the lexicon */
+#endif
+    /* lift the lowest levels until the rest can be merged at once */
+    for (level = 0; total_runs > MAX_RUNS; level++)
+        if (level_runs[level] != 0)
+            add_run(merge_level(level), level + 1);
+    for (n_runs = 0, level = MAX_LEVELS; level-- > 0; )
+    {
+        memcpy(run_file + n_runs, level_file[level],
+               level_runs[level] * sizeof *run_file);
+        n_runs += level_runs[level];
+        level_runs[level] = 0;
+    }
+    total_runs = 0;
+
+    start_automat();
+    merge_runs(NULL);
+    finish_automat();
+}
+
+#ifndef USE_VALUES
+char *layout_name[] = {"built", "flat", "tree", "inclusion"};
+unsigned char *tune_text;           /* sample queries as symbols (-m ... */
+size_t tune_query[TUNE_QUERIES + 1];    /* objective); start of each */
+size_t tune_n;                      /* number of queries */
+
+/*
+** Put the transitions of a tree-shaped state at pos, from its k-th
+** node down, into trans after n others in label order. Return their
+** number. Words of any layout are read bit by bit here, as the
+** transition union describes only the built one.
+*/
+unsigned tree_words(unsigned *aut, unsigned pos, unsigned k,
+                    unsigned *trans, unsigned n)
+{
+    unsigned w = aut[pos + k - 1];
+
+    if (!TREE_LLAST(w))
+        n = tree_words(aut, pos, 2 * k, trans, n);
+    trans[n++] = w;
+    if (!TREE_RLAST(w))
+        n = tree_words(aut, pos, 2 * k + 1, trans, n);
+    return n;
+}
+
+/*
+** Put transitions left..right of trans (label, term and dest in the
+** low bits) into a complete binary tree at node k of state,
+** like make_tree.
+*/
+void place_tree(unsigned *trans, int left, int right, unsigned *state,
+                unsigned k, int full)
+{
+    int size, sel, rest;
+
+    size = right - left + 1;
+    if (full == -1)
+    {
+        full = 0;
+        while (2 * full + 1 < size)
+            full = 2 * full + 1;
+    }
+    sel = left + full / 2;
+    rest = size - full;
+    if (rest > (full + 1) / 2)
+        sel += (full + 1) / 2;
+    else
+        sel += rest;
+
+    state[k] = RAW_TREE(trans[sel]);
+    if (left > sel - 1)
+        state[k] |= 1;          /* llast */
+    else
+        place_tree(trans, left, sel - 1, state, k + k + 1, full / 2);
+    if (sel + 1 > right)
+        state[k] |= 2;          /* rlast */
+    else
+        place_tree(trans, sel + 1, right, state, k + k + 2, full / 2);
+}
+
+/*
+** Return a copy of an image of given size with states in layout to
+** (flat or tree) made of the states of aut in layout from. Each state
+** keeps its place and size, so the transitions need not be changed.
+*/
+unsigned *convert_image(unsigned *aut, unsigned size, unsigned start,
+                        unsigned from, unsigned to)
+{
+    unsigned trans[MAX_CHARS + 1];
+    unsigned *image, *stack, n, i, pos, dest, top = 0;
+    unsigned char *seen;
+
+    image = (unsigned *) calloc(size, sizeof *image);
+    stack = (unsigned *) malloc(size * sizeof *stack);
+    seen = (unsigned char *) calloc(size, 1);
+    if (image == NULL || stack == NULL || seen == NULL)
+        error("Not enough memory.");
+
+    image[0] = aut[0];
+    stack[top++] = start;
+    seen[start] = 1;
+    while (top > 0)
+    {
+        pos = stack[--top];
+        if (from == LAYOUT_TREE)
+            n = tree_words(aut, pos, 1, trans, 0);
+        else
+        {
+            n = 0;
+            do
+                trans[n] = aut[pos + n];
+            while (!FLAT_LAST(trans[n++]));
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            dest = from == LAYOUT_TREE ? TREE_DEST(trans[i])
+                                       : FLAT_DEST(trans[i]);
+            trans[i] = (trans[i] & RAW_LABEL_TERM) | dest;
+            if (dest != 0 && !seen[dest])
+            {
+                seen[dest] = 1;
+                stack[top++] = dest;
+            }
+        }
+
+        if (to == LAYOUT_TREE)
+            place_tree(trans, 0, n - 1, image + pos, 0, -1);
+        else
+            for (i = 0; i < n; i++)
+                image[pos + i] = RAW_FLAT(trans[i]) | (i == n - 1);
+    }
+
+    free(seen);
+    free(stack);
+    return image;
+}
+
+/*
+** Check if the string of len symbols is in the image aut with states
+** in given layout, starting at start.
+*/
+int tune_lookup(unsigned *aut, unsigned layout, unsigned start,
+                unsigned char *str, size_t len)
+{
+    unsigned pos = start, t = 0, k, w;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (pos == 0)
+            return 0;
+        w = str[i];
+        if (layout == LAYOUT_TREE)
+        {
+            for (k = 1; ; )
+            {
+                t = pos + k - 1;
+                if (RAW_LABEL(aut[t]) == w)
+                    break;
+                if (RAW_LABEL(aut[t]) > w)
+                {
+                    if (TREE_LLAST(aut[t]))
+                        return 0;
+                    k = 2 * k;
+                }
+                else
+                {
+                    if (TREE_RLAST(aut[t]))
+                        return 0;
+                    k = 2 * k + 1;
+                }
+            }
+            pos = TREE_DEST(aut[t]);
+        }
+        else if (layout == LAYOUT_INCLUSION)
+        {
+            /* a state holding another one is not sorted */
+            for (t = pos; RAW_LABEL(aut[t]) != w; t++)
+                if (FLAT_LAST(aut[t]))
+                    return 0;
+            pos = FLAT_DEST(aut[t]);
+        }
+        else
+        {
+            for (t = pos; RAW_LABEL(aut[t]) < w && !FLAT_LAST(aut[t]); t++)
+                ;
+            if (RAW_LABEL(aut[t]) != w)
+                return 0;
+            pos = FLAT_DEST(aut[t]);
+        }
+    }
+    return len > 0 && RAW_TERM(aut[t]);
+}
+
+/*
+** Read every stride-th string of the lexicon file into tune_text,
+** up to TUNE_QUERIES of them. With USE_UTF8 they are turned into
+** symbols; code points missing from the alphabet become symbol 0,
+** which no transition has.
+*/
+void read_queries(size_t stride)
+{
+    unsigned char str[MAX_STR_LEN + 2];
+    size_t len, size = 0, n;
+#ifdef USE_UTF8
+    unsigned char *p;
+    unsigned s;
+#endif
+
+    if ((tune_text = (unsigned char *) malloc(size = 1 << 16)) == NULL)
+        error("Not enough memory.");
+    tune_n = 0;
+    tune_query[0] = 0;
+    for (n = 0; tune_n < TUNE_QUERIES && (len = read_string(str)) != 0; n++)
+    {
+        if (n % stride != 0)
+            continue;
+#ifdef USE_UTF8
+        for (p = str, len = 0; *p; str[len++] = (unsigned char) s)
+            if ((s = NEXT_SYMBOL(p)) == MAX_CHARS)
+                s = 0;
+#endif
+        if (tune_query[tune_n] + len > size
+            && (tune_text = (unsigned char *) realloc(tune_text, size *= 2))
+            == NULL)
+            error("Not enough memory.");
+        memcpy(tune_text + tune_query[tune_n], str, len);
+        tune_query[tune_n + 1] = tune_query[tune_n] + len;
+        tune_n++;
+    }
+    if (tune_n == 0)
+        error("No queries to replay.");
+}
+
+/*
+** Return a copy of the automaton with the pseudo state
+** pointing to the start state.
+*/
+unsigned *copy_image(void)
+{
+    unsigned *image;
+
+    if ((image = (unsigned *) malloc(aut_size * sizeof *image)) == NULL)
+        error("Not enough memory.");
+    memcpy(image, automat, aut_size * sizeof *image);
+    image[0] = start_state;
+    return image;
+}
+
+/*
+** Make the automaton in each layout this program can produce: the
+** built one, the other of flat and tree (the states only change
+** order inside), and with USE_INCLUSION also the flat one built
+** without including states. Replay queries from query_name, or a
+** sample of the lexicon, on each image and keep the one best for
+** objective: "speed" (most lookups per second) or "size".
+*/
+void tune_automat(char *objective, char *query_name)
+{
+    unsigned *image[3], layout[3], size[3], start[3];
+    double time[3];
+    unsigned long found[3], strings, chars;
+    int n = 0, best, by_size, i, r;
+    size_t q;
+    clock_t t;
+
+    if ((by_size = !strcmp(objective, "size")) == 0
+        && strcmp(objective, "speed") != 0)
+        error("The objective must be speed or size.");
+
+#ifdef USE_INCLUSION
+    use_inclusion = 0;
+    make_automat();
+    image[n] = copy_image();
+    layout[n] = LAYOUT_FLAT;
+    size[n] = aut_size;
+    start[n++] = start_state;
+    free_tables();
+    rewind_dict();
+    n_strings = n_chars = 0;
+#ifdef PRINT_STATISTICS
+    n_states = n_trans = n_term_trans = 0;
+#endif
+    use_inclusion = 1;
+#endif
+    make_automat();
+    image[n] = copy_image();
+    layout[n] = LAYOUT;
+    size[n] = aut_size;
+    start[n++] = start_state;
+    if (layout[0] == LAYOUT_TREE || size[0] <= 1u << 21)
+    {
+        layout[n] = layout[0] == LAYOUT_TREE ? LAYOUT_FLAT : LAYOUT_TREE;
+        image[n] = convert_image(image[0], size[0], start[0],
+                                 layout[0], layout[n]);
+        size[n] = size[0];
+        start[n++] = start[0];
+    }
+    else
+        printf("The automaton is too large for the tree layout.\n");
+
+    strings = n_strings;
+    chars = n_chars;
+    if (query_name != NULL)
+    {
+        close_dict();
+        open_dict(query_name, "r");
+        read_queries(1);
+    }
+    else
+    {
+        rewind_dict();
+        read_queries(strings / TUNE_QUERIES + 1);
+    }
+    n_strings = strings;
+    n_chars = chars;
+
+    for (i = 0; i < n; i++)
+        time[i] = 0.0;
+    for (r = 0; r < TUNE_ROUNDS; r++)
+        for (i = 0; i < n; i++)
+        {
+            t = clock();
+            for (found[i] = 0, q = 0; q < tune_n; q++)
+                found[i] += tune_lookup(image[i], layout[i], start[i],
+                                        tune_text + tune_query[q],
+                                        tune_query[q + 1] - tune_query[q]);
+            time[i] += (double) (clock() - t) / CLOCKS_PER_SEC;
+        }
+
+    for (best = i = 0; i < n; i++)
+    {
+        if (found[i] != found[0])
+            error("The layouts of states give different results.");
+        if (by_size ? size[i] < size[best]
+                      || (size[i] == size[best] && time[i] < time[best])
+                    : time[i] < time[best]
+                      || (time[i] == time[best] && size[i] < size[best]))
+            best = i;
+        printf("%s layout: %u bytes\t", layout_name[layout[i]],
+               size[i] * (unsigned) sizeof automat[0]);
+        if (time[i] != 0.0)
+            printf("%.lf lookups/s\n", tune_n * TUNE_ROUNDS / time[i]);
+        else
+            printf("too fast to measure\n");
+    }
+    printf("%lu of %lu queries found\tChosen layout: %s\n",
+           found[0], (unsigned long) tune_n, layout_name[layout[best]]);
+
+    memcpy(automat, image[best], size[best] * sizeof automat[0]);
+    aut_size = size[best];
+    start_state = start[best];
+    aut_layout = layout[best];
+    for (i = 0; i < n; i++)
+        free(image[i]);
+    free(tune_text);
+}
+#endif
+
+#ifndef USE_INCLUSION
+unsigned char *reg_seen;            /* states already in the hash table */
+
+/*
+** Put the state at pos and all states reachable from it
+** into the hash table, as make_state would have done.
+*/
+void register_states(unsigned pos)
+{
+    static transition state[MAX_CHARS + 1];
+#ifdef USE_VALUES
+    static unsigned state_value[MAX_CHARS + 1];
+#endif
+    unsigned t, n = 0, hash_addr;
+
+    if (pos >= aut_size)
+        error("Error in automaton file.");
+    if (reg_seen[pos])
+        return;
+    reg_seen[pos] = 1;
+
+    /* states below come first, the buffer is shared */
+    for (t = first_trans(automat, pos, NULL); t;
+         t = next_trans(automat, pos, t, 1))
+        if (automat[t].b.dest)
+            register_states(automat[t].b.dest);
+
+    /* take the transitions in the form they had in the larval state */
+    t = first_trans(automat, pos, NULL);
+    do
+    {
+        if (t >= aut_size || n > MAX_CHARS)
+            error("Error in automaton file.");
+        state[n] = automat[t];
+#ifdef USE_TREE
+        state[n].b.llast = state[n].b.rlast = 0;
+#endif
+#ifdef USE_VALUES
+        state_value[n] = automat_value[t];
+#endif
+#ifdef PRINT_STATISTICS
+        n_term_trans += automat[t].b.term;
+#endif
+        n++;
+    } while ((t = next_trans(automat, pos, t, 1)) != 0);
+
+    hash_addr = hash_state(state, n);
+#ifdef USE_VALUES
+    for (t = 0; t < n; t++)
+        hash_addr = (hash_addr + state_value[t] * 40503u) % HT_SIZE;
+#endif
+    register_state(hash_addr, pos, n);
+#ifdef PRINT_STATISTICS
+    n_states++;
+    n_trans += n;
+#endif
+}
+
+/*
+** Rebuild the hash table from the states reachable in the automaton.
+*/
+void rebuild_register(void)
+{
+    unsigned size = aut_size;
+
+    free_tables();
+    prepare_tables();
+    aut_size = size;
+#ifdef PRINT_STATISTICS
+    n_states = n_trans = n_term_trans = 0;
+#endif
+
+    /* the pseudo state gives way to the zero state again */
+    automat[0].all_fields = 0;
+#ifdef USE_TREE
+    automat[0].b.llast = automat[0].b.rlast = 1;
+#else
+    automat[0].b.last = 1;
+#endif
+#ifdef USE_VALUES
+    automat_value[0] = 0;
+#endif
+
+    if ((reg_seen = (unsigned char *) calloc(aut_size, 1)) == NULL)
+        error("Not enough memory.");
+    register_states(0);
+    register_states(start_state);
+    free(reg_seen);
+}
+
+/*
+** Prepare a loaded automaton for adding strings after its last
+** one: rebuild the hash table and turn the states along the last
+** string back into larval states.
+*/
+void reopen_automat(void)
+{
+    unsigned pos, t, next;
+    size_t i;
+
+    rebuild_register();
+
+    /* follow the last transitions from the start state */
+    last_len = 0;
+    last_str[0] = '\0';
+    for (pos = start_state, i = 0; pos; pos = automat[t].b.dest, i++)
+    {
+        if (i >= MAX_STR_LEN)
+            error("Error in automaton file.");
+        l_state_len[i] = 0;
+        for (t = first_trans(automat, pos, NULL);
+             (next = next_trans(automat, pos, t, 1)) != 0; t = next)
+        {
+            larval_state[i][l_state_len[i]] = automat[t];
+#ifdef USE_TREE
+            larval_state[i][l_state_len[i]].b.llast = 0;
+            larval_state[i][l_state_len[i]].b.rlast = 0;
+#else
+            larval_state[i][l_state_len[i]].b.last = 0;
+#endif
+#ifdef USE_VALUES
+            larval_value[i][l_state_len[i]] = automat_value[t];
+#endif
+            l_state_len[i]++;
+        }
+        last_str[i] = (unsigned char) automat[t].b.attr;
+        is_terminal[i + 1] = automat[t].b.term;
+#ifdef USE_VALUES
+        last_value[i] = automat_value[t];
+#endif
+        l_state_len[i + 1] = 0;
+        last_len = i + 1;
+    }
+    last_str[last_len] = '\0';
+}
+
+/*
+** Add the strings of the lexicon file, all greater than those
+** already there, to the automaton read from fname.
+*/
+void append_automat(char *fname)
+{
+#ifdef USE_UTF8
+    unsigned old_codes[MAX_CHARS], new_codes[MAX_CHARS];
+    unsigned i;
+#endif
+
+    read_automat(fname);
+#ifdef USE_UTF8
+    /* extend the alphabet; symbols keep their order, so renumbering */
+    /* them does not change the order of transitions */
+    memcpy(old_codes, alphabet, sizeof old_codes);
+    make_alphabet(0);
+    memcpy(new_codes, alphabet, sizeof new_codes);
+    merge_alphabets(old_codes, new_codes);
+    for (i = 1; i < aut_size; i++)
+        automat[i].b.attr = map_a[automat[i].b.attr];
+#endif
+    reopen_automat();
+    add_lexicon();
+    finish_automat();
+}
+
+#ifndef USE_VALUES
+/*
+** Copy the transitions of the state at pos in label order into
+** a larval state, leaving out the transition old and putting
+** new_trans in its place (unless new_trans.all_fields is 0).
+** Return the number of transitions.
+*/
+unsigned copy_state(unsigned pos, unsigned old, transition new_trans,
+                    transition *state)
+{
+    unsigned t, n = 0;
+    int added = !new_trans.all_fields;
+
+    /* the zero state has no real transitions */
+    for (t = pos ? first_trans(automat, pos, NULL) : 0; t;
+         t = next_trans(automat, pos, t, 1))
+    {
+        if (t >= aut_size)
+            error("Error in automaton file.");
+        if (!added && automat[t].b.attr >= new_trans.b.attr)
+        {
+            state[n++] = new_trans;
+            added = 1;
+        }
+        if (t == old)
+            continue;
+        state[n] = automat[t];
+#ifdef USE_TREE
+        state[n].b.llast = state[n].b.rlast = 0;
+#else
+        state[n].b.last = 0;
+#endif
+        n++;
+    }
+    if (!added)
+        state[n++] = new_trans;
+    return n;
+}
+
+/*
+** Add (or remove) a string of q symbols to (from) the automaton.
+** States along the string are never changed in place: new ones are
+** made from the end of the string up and go through make_state,
+** so the automaton stays minimal. The old ones become garbage
+** unless other paths still lead to them. Return 1 if the language
+** of the automaton changed.
+*/
+int edit_string(unsigned char *str, size_t q, int add)
+{
+    static transition state[MAX_CHARS + 1];
+    unsigned path[MAX_STR_LEN + 1];     /* states along str */
+    unsigned path_trans[MAX_STR_LEN];   /* transitions along str */
+    unsigned pos = start_state, t = 0, child;
+    transition new_trans;
+    size_t i, k;
+    int term;
+
+    /* follow the string as far as it goes */
+    for (k = 0; k < q; k++)
+    {
+        path[k] = pos;
+        for (t = pos ? first_trans(automat, pos, NULL) : 0;
+             t && automat[t].b.attr != str[k];
+             t = next_trans(automat, pos, t, 1))
+            ;
+        if (!t)
+            break;
+        path_trans[k] = t;
+        pos = automat[t].b.dest;
+    }
+
+    if (k == q)
+    {
+        /* the string has a path: change its last transition */
+        if (automat[t].b.term == add)
+            return 0;
+        i = q - 1;
+        child = automat[t].b.dest;
+        term = add;
+    }
+    else
+    {
+        if (!add)
+            return 0;
+        /* make a chain of new states for the rest of the string */
+        new_trans.all_fields = 0;
+        child = 0;
+        for (i = q - 1; i > k; i--)
+        {
+            new_trans.b.dest = child;
+            new_trans.b.attr = str[i];
+            new_trans.b.term = i == q - 1;
+            state[0] = new_trans;
+            child = make_state(state, 1);
+        }
+        path_trans[k] = 0;
+        term = k == q - 1;
+    }
+
+    /* replace the states along the string from the end up */
+    while (1)
+    {
+        new_trans.all_fields = 0;
+        if (child || term)
+        {
+            /* a transition to nothing is dropped */
+            new_trans.b.dest = child;
+            new_trans.b.attr = str[i];
+            new_trans.b.term = term;
+        }
+        child = make_state(state, copy_state(path[i], path_trans[i],
+                                             new_trans, state));
+        if (i-- == 0)
+            break;
+        term = automat[path_trans[i]].b.term;
+    }
+    start_state = child;
+    return 1;
+}
+
+/*
+** Mark the states reachable from pos in new_pos.
+*/
+void mark_states(unsigned pos, unsigned *new_pos)
+{
+    unsigned t;
+
+    if (new_pos[pos])
+        return;
+    new_pos[pos] = 1;
+    for (t = first_trans(automat, pos, NULL); t;
+         t = next_trans(automat, pos, t, 1))
+    {
+        if (t >= aut_size || automat[t].b.dest >= aut_size)
+            error("Error in automaton file.");
+        if (automat[t].b.dest)
+            mark_states(automat[t].b.dest, new_pos);
+    }
+}
+
+/*
+** Remove unreachable states from the automaton. Live states are
+** moved down in order, their transitions redirected and the hash
+** table rebuilt.
+*/
+void compact_automat(void)
+{
+    unsigned *new_pos;
+    unsigned pos, t, n, size = 1;
+
+    if ((new_pos = (unsigned *) calloc(aut_size, sizeof(unsigned))) == NULL)
+        error("Not enough memory.");
+    if (start_state)
+        mark_states(start_state, new_pos);
+
+    /* the zero state stays at 0 */
+    for (pos = 1; pos < aut_size; pos++)
+        if (new_pos[pos])
+        {
+            /* count transitions of the state */
+            n = 0;
+            for (t = first_trans(automat, pos, NULL); t;
+                 t = next_trans(automat, pos, t, 1))
+                n++;
+            memmove(&automat[size], &automat[pos], n * sizeof automat[0]);
+            new_pos[pos] = size;
+            size += n;
+            pos += n - 1;
+        }
+    for (t = 1; t < size; t++)
+        automat[t].b.dest = new_pos[automat[t].b.dest];
+    start_state = new_pos[start_state];
+    aut_size = size;
+    free(new_pos);
+
+    rebuild_register();
+}
+
+/*
+** Apply the edit file to the automaton read from fname. Lines
+** "+string" add strings and lines "-string" remove them, in any
+** order (e.g. a file made by -d). Garbage is collected whenever
+** it makes up half of the automaton.
+*/
+void edit_automat(char *fname)
+{
+    unsigned char s1[MAX_STR_LEN + 1];
+    size_t q;
+    unsigned gc_size;
+    unsigned long n_edits = 0;
+#ifdef USE_UTF8
+    unsigned old_codes[MAX_CHARS], new_codes[MAX_CHARS];
+    unsigned i;
+#endif
+
+    read_automat(fname);
+#ifdef USE_UTF8
+    memcpy(old_codes, alphabet, sizeof old_codes);
+    make_alphabet(1);
+    memcpy(new_codes, alphabet, sizeof new_codes);
+    merge_alphabets(old_codes, new_codes);
+    for (i = 1; i < aut_size; i++)
+        automat[i].b.attr = map_a[automat[i].b.attr];
+#endif
+    rebuild_register();
+    gc_size = 2 * aut_size + MIN_GC_SIZE;
+
+    while ((q = read_string(s1)) != 0)
+    {
+        if (s1[0] != '+' && s1[0] != '-')
+            error("Lines of the edit file must begin with + or -.");
+#ifdef USE_UTF8
+        q = decode_string(s1 + 1) + 1;
+#endif
+        if (q == 1)
+            continue;           /* the empty string */
+        if (aut_size > gc_size
+            || aut_size + q * (MAX_CHARS + 1) >= MAX_AUT_SIZE)
+        {
+            compact_automat();
+            gc_size = 2 * aut_size + MIN_GC_SIZE;
+        }
+        n_edits += edit_string(s1 + 1, q - 1, s1[0] == '+');
+    }
+    compact_automat();
+    printf("%lu strings changed\n", n_edits);
+}
+#endif
+#endif
+
+/*
+** Check if the given string exists in the automaton.
+*/
+int check_string(unsigned char *str)
+{
+    unsigned pos = 0;
+    unsigned w;
+    size_t k;
+#if defined USE_TREE
+    unsigned t = 0;
+#elif defined USE_VALUES
+    unsigned value = 0;
+#endif
+
+    /* most strings that are not there never reach the automaton */
+    if (bloom_filter != NULL && !bloom_probe(bloom_hash(str), 0))
+        return 0;
+
+#ifdef USE_TREE
+    pos = automat[pos].b.dest;
+    if (jump_depth && (k = jump_index(&str)) != JUMP_NONE)
+    {
+        if ((t = jump_table[k]) == 0)
+            return 0;
+        pos = automat[t].b.dest;
+    }
+
+    while (*str)
+    {
+        if (!pos)
+            return 0;
+        if (pos > aut_size)
+            error("Error in automaton file.");
+        w = NEXT_SYMBOL(str);
+
+        /* search the tree for current character */
+        if ((t = find_in_tree(pos, w)) == 0)
+            return 0;
+        pos = automat[t].b.dest;    /* get index of new state */
+    }
+    return automat[t].b.term;
+#else
+    /* the first symbols lead straight to a transition */
+    if (jump_depth && (k = jump_index(&str)) != JUMP_NONE)
+    {
+        if ((pos = jump_table[k]) == 0)
+            return 0;
+#ifdef USE_VALUES
+        value = jump_value[k];
+#endif
+    }
+
+    while (*str)
+    {
+        /* get pointer to new state */
+        pos = automat[pos].b.dest;
+        w = NEXT_SYMBOL(str);
+
+        if (!pos)
+            return 0;
+
+        if (pos > aut_size)
+            error("Error in automaton file.");
+        /* find current character in state */
+        while (automat[pos].b.attr != w)
+        {
+            if (automat[pos++].b.last)
+                return 0;
+            if (pos > aut_size)
+                error("Error in automaton file.");
+        }
+#ifdef USE_VALUES
+        value += automat_value[pos];
+#endif
+    }
+#ifdef USE_VALUES
+    /* the string must also have the value it was read with */
+    return automat[pos].b.term && value == str_value;
+#else
+    return automat[pos].b.term;
+#endif
+#endif
+}
+
+/*
+** Prepare the default folding table: letters are folded to lower
+** case and Polish letters additionally lose their diacritics
+** (ISO-8859-2, or UTF-8 with USE_UTF8).
+*/
+void prepare_fold_table(void)
+{
+    static const char *classes[] =
+    {
+#ifdef USE_UTF8
+        "a\xc4\x85\xc4\x84", "c\xc4\x87\xc4\x86", "e\xc4\x99\xc4\x98",
+        "l\xc5\x82\xc5\x81", "n\xc5\x84\xc5\x83", "o\xc3\xb3\xc3\x93",
+        "s\xc5\x9b\xc5\x9a", "z\xc5\xba\xc5\xb9\xc5\xbc\xc5\xbb", NULL
+#else
+        "a\xb1\xa1", "c\xe6\xc6", "e\xea\xca", "l\xb3\xa3", "n\xf1\xd1",
+        "o\xf3\xd3", "s\xb6\xa6", "z\xbc\xac\xbf\xaf", NULL
+#endif
+    };
+    unsigned char pair[3];
+    int i;
+
+    for (i = 0; i < MAX_CHARS; i++)
+        fold_table[i] = (unsigned char) i;
+    pair[2] = '\0';
+    for (i = 'a'; i <= 'z'; i++)
+    {
+        pair[0] = (unsigned char) i;
+        pair[1] = (unsigned char) (i - 'a' + 'A');
+        add_fold_class(pair);
+    }
+    for (i = 0; classes[i]; i++)
+        add_fold_class((unsigned char *) classes[i]);
+
+    link_fold_table();
+}
+
+/*
+** Read the folding table from a file. Each line lists characters
+** that are equivalent; all of them are folded to the first one.
+*/
+void read_fold_table(char *fname)
+{
+    FILE *fold_file;
+    unsigned char cls[MAX_STR_LEN + 1];
+    int c, i = 0;
+
+    if ((fold_file = fopen(fname, "rb")) == NULL)
+        error("Cannot open folding table file.");
+
+    for (c = 0; c < MAX_CHARS; c++)
+        fold_table[c] = (unsigned char) c;
+    do
+    {
+        c = getc(fold_file);
+        if (c == '\n' || c == '\r' || c == EOF)
+        {
+            cls[i] = '\0';
+            add_fold_class(cls);
+            i = 0;
+        }
+        else if (i < MAX_STR_LEN)
+            cls[i++] = (unsigned char) c;
+    } while (c != EOF);
+    fclose(fold_file);
+
+    link_fold_table();
+}
+
+/*
+** Fold all the characters of a class (a string in the lexicon
+** encoding) to the folded form of the first one that occurs
+** in the automaton.
+*/
+void add_fold_class(unsigned char *cls)
+{
+    unsigned char *p;
+    unsigned rep = MAX_CHARS;
+#ifdef USE_UTF8
+    unsigned c, s;
+
+    for (p = cls; *p && rep == MAX_CHARS; )
+        if ((s = fold_symbol(decode_utf8(&p))) != MAX_CHARS)
+            rep = fold_table[s];
+    if (rep == MAX_CHARS)
+        return;
+
+    for (p = cls; *p; )
+    {
+        c = decode_utf8(&p);
+        if ((s = code_to_symbol(c)) != MAX_CHARS)
+            fold_table[s] = (unsigned char) rep;
+        else if (c != MAX_CODE_POINT)
+            set_page(fold_page, c, (unsigned char) rep);
+    }
+#else
+    if (!*cls)
+        return;
+    rep = fold_table[*cls];
+    for (p = cls; *p; p++)
+        fold_table[*p] = (unsigned char) rep;
+#endif
+}
+
+/*
+** Link characters of the same folded form into cycles,
+** so that all variants of a character can be visited.
+*/
+void link_fold_table(void)
+{
+    int first[MAX_CHARS], prev[MAX_CHARS];
+    int c, f;
+
+    for (f = 0; f < MAX_CHARS; f++)
+        first[f] = -1;
+    for (c = 0; c < MAX_CHARS; c++)
+    {
+        f = fold_table[c];
+        if (first[f] == -1)
+            first[f] = c;
+        else
+            fold_next[prev[f]] = (unsigned char) c;
+        prev[f] = c;
+    }
+    for (f = 0; f < MAX_CHARS; f++)
+        if (first[f] != -1)
+            fold_next[prev[f]] = (unsigned char) first[f];
+}
+
+#ifdef USE_TREE
+/*
+** Find a transition labelled with w in a tree-shaped state
+** at position pos. Return its index or 0 if there is none.
+** Node k of the tree has children 2k and 2k + 1, so the four
+** grandchildren lie side by side and are fetched while node k is
+** compared. The only branch leaves the loop: the flag ending the
+** descent is picked by shifting the word, as llast and rlast are
+** its two lowest bits.
+*/
+unsigned find_in_tree(unsigned pos, unsigned w)
+{
+    transition *node = automat + pos - 1;   /* node k is node[k] */
+    unsigned k = 1, right;
+
+    while (1)
+    {
+        PREFETCH(node + 4 * k);
+        right = node[k].b.attr < w;
+        if ((node[k].b.attr == w) | (node[k].all_fields >> right & 1))
+            break;
+        k = 2 * k + right;
+    }
+    return node[k].b.attr == w ? pos + k - 1 : 0;
+}
+
+/*
+** The descent find_in_tree replaced, kept to compare them (-k).
+*/
+unsigned find_in_tree_loop(unsigned pos, unsigned w)
+{
+    unsigned offset = 1;
+    transition e;
+
+    while (1)
+    {
+        e = automat[pos + offset - 1];
+        if (e.b.attr == w)
+            return pos + offset - 1;
+        if (e.b.attr > w)
+        {
+            if (e.b.llast)
+                return 0;
+            offset = offset * 2;
+        }
+        else
+        {
+            if (e.b.rlast)
+                return 0;
+            offset = offset * 2 + 1;
+        }
+    }
+}
+
+/*
+** Time find_in_tree and find_in_tree_loop on states of growing size
+** filling BENCH_WORDS transitions of automat. A state of n transitions
+** has the labels 1, 3, ..., 2n - 1; the queries pick a random state
+** and a random label, so about half of them fail.
+*/
+void bench_tree_search(void)
+{
+    static unsigned q_pos[BENCH_QUERIES];
+    static unsigned char q_sym[BENCH_QUERIES];
+    static int sizes[] = {1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 63, 64, 127};
+    transition state[MAX_CHARS];
+    unsigned n, i, n_states, r = 12345;
+    unsigned long hits[2];
+    double time[2];
+    clock_t t;
+    int s, j;
+
+    for (s = 0; s < (int) (sizeof sizes / sizeof sizes[0]); s++)
+    {
+        n = sizes[s];
+        for (i = 0; i < n; i++)
+        {
+            state[i].all_fields = 0;
+            state[i].b.attr = 2 * i + 1;
+            state[i].b.dest = i;
+        }
+        make_tree(state, 0, n - 1, 0, -1);
+        n_states = BENCH_WORDS / n;
+        for (i = 0; i < n_states; i++)
+            memcpy(&automat[1 + i * n], temp_state, n * sizeof automat[0]);
+
+        for (i = 0; i < BENCH_QUERIES; i++)
+        {
+            r = r * 1103515245 + 12345;     /* a linear congruential */
+            q_pos[i] = 1 + (r >> 8) % n_states * n;    /* generator */
+            q_sym[i] = (unsigned char) (r >> 24) % (2 * n + 1);
+        }
+
+        for (j = 0; j < 2; j++)
+        {
+            hits[j] = 0;
+            t = clock();
+            for (i = 0; i < BENCH_QUERIES; i++)
+                hits[j] += (j ? find_in_tree(q_pos[i], q_sym[i])
+                              : find_in_tree_loop(q_pos[i], q_sym[i])) != 0;
+            time[j] = (double) (clock() - t) / CLOCKS_PER_SEC;
+        }
+        if (hits[0] != hits[1])
+            error("The searches in a tree give different results.");
+
+        printf("%3u transitions: loop %.1f, branchless %.1f"
+               " million lookups/s\n", n,
+               time[0] ? BENCH_QUERIES / time[0] / 1e6 : 0.0,
+               time[1] ? BENCH_QUERIES / time[1] / 1e6 : 0.0);
+    }
+}
+#endif
+
+/*
+** Check if the state at pos is known to reject the rest of fold_str
+** from position i in the current folding lookup.
+*/
+int fold_failed(unsigned pos, unsigned i)
+{
+    size_t h;
+
+    if (fold_memo_count == 0)
+        return 0;
+    for (h = HASH_PAIR(pos, i) & (fold_memo_size - 1);
+         fold_memo[3 * h + 2] == fold_lookup;
+         h = (h + 1) & (fold_memo_size - 1))
+        if (fold_memo[3 * h] == pos && fold_memo[3 * h + 1] == i)
+            return 1;
+    return 0;
+}
+
+/*
+** Remember that the state at pos rejects the rest of fold_str from
+** position i. Entries of earlier lookups count as free.
+*/
+void add_fold_failure(unsigned pos, unsigned i)
+{
+    unsigned *old_memo = fold_memo;
+    size_t old_size = fold_memo_size, h;
+
+    if (2 * (fold_memo_count + 1) > fold_memo_size)
+    {
+        /* grow the table and move the entries of this lookup */
+        fold_memo_size = fold_memo_size ? 2 * fold_memo_size : 1024;
+        if ((fold_memo = (unsigned *) calloc(3 * fold_memo_size,
+                                             sizeof(unsigned))) == NULL)
+            error("Not enough memory.");
+        fold_memo_count = 0;
+        for (h = 0; h < old_size; h++)
+            if (old_memo[3 * h + 2] == fold_lookup)
+                add_fold_failure(old_memo[3 * h], old_memo[3 * h + 1]);
+        free(old_memo);
+    }
+
+    for (h = HASH_PAIR(pos, i) & (fold_memo_size - 1);
+         fold_memo[3 * h + 2] == fold_lookup;
+         h = (h + 1) & (fold_memo_size - 1))
+        ;
+    fold_memo[3 * h] = pos;
+    fold_memo[3 * h + 1] = i;
+    fold_memo[3 * h + 2] = fold_lookup;
+    fold_memo_count++;
+}
+
+/*
+** Follow the transition at pos and check if the rest of a string
+** is accepted, allowing any character of the same folded form
+** at each step. States that failed at a position are remembered,
+** so each of them is searched once and the lookup needs no limit.
+*/
+int check_fold(unsigned pos, unsigned char *str)
+{
+    unsigned t;
+#ifdef USE_TREE
+    unsigned char w;
+#else
+    unsigned char f;
+#endif
+
+    if (*str == '\0')
+        return automat[pos].b.term;
+
+    pos = automat[pos].b.dest;
+    if (!pos || fold_failed(pos, (unsigned) (str - fold_str)))
+        return 0;
+    if (pos > aut_size)
+        error("Error in automaton file.");
+
+#ifdef USE_TREE
+    /* try the original character first, then its other forms */
+    w = *str;
+    do
+    {
+        if ((t = find_in_tree(pos, w)) != 0)
+        {
+            if (check_fold(t, str + 1))
+                return 1;
+        }
+        w = fold_next[w];
+    } while (w != *str);
+#else
+    f = fold_table[*str];
+    for (t = pos; ; t++)
+    {
+        if (t > aut_size)
+            error("Error in automaton file.");
+        if (fold_table[automat[t].b.attr] == f && check_fold(t, str + 1))
+            return 1;
+        if (automat[t].b.last)
+            break;
+    }
+#endif
+    add_fold_failure(pos, (unsigned) (str - fold_str));
+    return 0;
+}
+
+/*
+** Check if the given string exists in the automaton
+** up to case and diacritics (as given by fold_table).
+*/
+int check_string_fold(unsigned char *str)
+{
+#ifdef USE_UTF8
+    unsigned char sym[MAX_STR_LEN + 2];
+    unsigned s;
+    int i = 0;
+
+    /* folding works on symbols, so decode the string first */
+    while (*str)
+    {
+        if ((s = fold_symbol(decode_utf8(&str))) == MAX_CHARS)
+            return 0;
+        sym[i++] = (unsigned char) s;
+    }
+    sym[i] = '\0';
+    str = sym;
+#endif
+    /* a new lookup frees the remembered failures */
+    if (++fold_lookup == 0)
+    {
+        if (fold_memo != NULL)
+            memset(fold_memo, 0, 3 * fold_memo_size * sizeof(unsigned));
+        fold_lookup = 1;
+    }
+    fold_memo_count = 0;
+    fold_str = str;
+    return check_fold(0, str);
+}
+
+/*
+** Check if the automaton is correct
+** (test all the strings from a lexicon).
+*/
+void test_automat(int (*check)(unsigned char *))
+{
+    n_strings = 0;
+    n_chars = 0;
+
+    while (read_string(temp_str))
+        if (!check(temp_str))
+            printf("String %s not found!\n", temp_str);
+}
+
+/*
+** Return the first transition (in label order) of the state at pos
+** in the automaton aut. Unless sorted is NULL, tell there whether
+** the transitions of the state lie in label order, which lets
+** next_trans step through them without searching the state.
+*/
+unsigned first_trans(transition *aut, unsigned pos, int *sorted)
+{
+#if defined USE_TREE
+    unsigned k = 1;
+
+    if (sorted != NULL)
+        *sorted = 1;
+    while (!aut[pos + k - 1].b.llast)
+        k = k + k;
+    return pos + k - 1;
+#elif defined USE_INCLUSION
+    /* reorganized states are not sorted */
+    unsigned best = pos;
+    int in_order = 1;
+
+    while (!aut[pos++].b.last)
+    {
+        if (aut[pos].b.attr < aut[pos - 1].b.attr)
+            in_order = 0;
+        if (aut[pos].b.attr < aut[best].b.attr)
+            best = pos;
+    }
+    if (sorted != NULL)
+        *sorted = in_order;
+    return best;
+#else
+    (void) aut;
+    if (sorted != NULL)
+        *sorted = 1;
+    return pos;
+#endif
+}
+
+/*
+** Return the transition that follows t (in label order)
+** in the state at pos, or 0 if t is the last one. sorted is
+** what first_trans told about the state.
+*/
+unsigned next_trans(transition *aut, unsigned pos, unsigned t, int sorted)
+{
+#if defined USE_TREE
+    unsigned k = t - pos + 1;
+
+    if (!aut[t].b.rlast)
+    {
+        /* leftmost element of the right subtree */
+        k = k + k + 1;
+        while (!aut[pos + k - 1].b.llast)
+            k = k + k;
+        return pos + k - 1;
+    }
+    /* go up while coming from the right */
+    while (k > 1 && (k & 1))
+        k >>= 1;
+    (void) sorted;
+    return k > 1 ? pos + (k >> 1) - 1 : 0;
+#elif defined USE_INCLUSION
+    /* find the smallest label greater than that of t */
+    unsigned best = 0;
+
+    if (sorted)
+        return aut[t].b.last ? 0 : t + 1;
+    do
+    {
+        if (aut[pos].b.attr > aut[t].b.attr
+            && (!best || aut[pos].b.attr < aut[best].b.attr))
+            best = pos;
+    } while (!aut[pos++].b.last);
+    return best;
+#else
+    (void) pos;
+    (void) sorted;
+    return aut[t].b.last ? 0 : t + 1;
+#endif
+}
+
+/*
+** Prepare an empty buffer of size bytes flushed to file, or one
+** that grows from size bytes (possibly 0) if file is NULL. Strings
+** are front-coded if coded is nonzero.
+*/
+void start_buffer(out_buffer *out, FILE *file, size_t size, int coded)
+{
+    out->data = NULL;
+    if (size != 0 && (out->data = (unsigned char *) malloc(size)) == NULL)
+        error("Not enough memory.");
+    out->size = size;
+    out->len = 0;
+    out->file = file;
+    out->coded = coded;
+    out->shared = 0;
+    out->turn = NULL;
+    out->ticket = 0;
+    out->n_strings = 0;
+    out->n_chars = 0;
+}
+
+/*
+** Write the buffered output, if any, to the file, first waiting
+** for the turn of the buffer if it has one.
+*/
+void flush_buffer(out_buffer *out)
+{
+    if (out->turn != NULL)
+        while (*out->turn != out->ticket)
+            YIELD();            /* earlier output is not written yet */
+    if (out->len != 0
+        && fwrite(out->data, 1, out->len, out->file) < out->len)
+        error("Error writing to file.");
+    out->len = 0;
+}
+
+/*
+** Append a string of given length and a newline to the buffer.
+** A front-coded string is written as the number of bytes it shares
+** with the last one (bytes of 255 and one below, summed) followed
+** by the rest of the string.
+*/
+void put_string(out_buffer *out, unsigned char *str, size_t len)
+{
+    size_t shared;
+
+    if (out->coded)
+    {
+        len -= shared = out->shared;
+        str += shared;
+        make_room(out, len + shared / 255 + 2);
+        for (; shared >= 255; shared -= 255)
+            out->data[out->len++] = 255;
+        out->data[out->len++] = (unsigned char) shared;
+    }
+    else
+        make_room(out, len + 1);
+    memcpy(out->data + out->len, str, len);
+    out->data[out->len + len] = '\n';
+    out->len += len + 1;
+    out->n_strings++;
+    out->n_chars += len + 1;
+}
+
+/*
+** Make sure the buffer can take len more bytes.
+*/
+void make_room(out_buffer *out, size_t len)
+{
+    if (out->len + len > out->size)
+    {
+        if (out->file)
+            flush_buffer(out);
+        else
+        {
+            out->size = 2 * out->size + len;
+            if ((out->data = (unsigned char *) realloc(out->data, out->size))
+                == NULL)
+                error("Not enough memory.");
+        }
+    }
+}
+
+#ifdef USE_VALUES
+/*
+** Append a string, a tab and its value to the buffer. The value
+** is formatted past the end of str, which must leave room for it.
+*/
+void put_value(out_buffer *out, unsigned char *str, size_t len,
+               unsigned value)
+{
+    len += sprintf((char *) str + len, "\t%u", value);
+    put_string(out, str, len);
+}
+#endif
+
+/*
+** List all the strings recognized from the state at pos,
+** each preceded by the given prefix. The automaton is walked
+** with an explicit stack; the current string is kept encoded,
+** so every string is written with a single copy. With USE_VALUES
+** value is that of the prefix and strings are listed with values.
+*/
+#ifdef USE_VALUES
+void list_strings(unsigned pos, unsigned char *prefix, size_t prefix_len,
+                  unsigned value, out_buffer *out)
+#else
+void list_strings(unsigned pos, unsigned char *prefix, size_t prefix_len,
+                  out_buffer *out)
+#endif
+{
+    unsigned state[MAX_STR_LEN + 2];    /* state at each depth */
+    unsigned trans[MAX_STR_LEN + 2];    /* current transition at each depth */
+    int sorted[MAX_STR_LEN + 2];        /* the state is in label order */
+    size_t len[MAX_STR_LEN + 3];        /* string length up to each depth */
+#ifdef USE_VALUES
+    unsigned sum[MAX_STR_LEN + 3];      /* value up to each depth */
+#endif
+    unsigned char str[4 * (MAX_STR_LEN + 2) + 12];
+    unsigned t;
+    int d = 0;
+
+    if (pos == 0)
+        return;
+
+    memcpy(str, prefix, prefix_len);
+    len[0] = prefix_len;
+#ifdef USE_VALUES
+    sum[0] = value;
+#endif
+    state[0] = pos;
+    trans[0] = first_trans(automat, pos, &sorted[0]);
+
+    while (d >= 0)
+    {
+        t = trans[d];
+        if (t > aut_size)
+            error("Error in automat file.");
+
+        /* add new character */
+#ifdef USE_UTF8
+        len[d + 1] = len[d] + encode_utf8(alphabet[automat[t].b.attr],
+                                          str + len[d]);
+#else
+        str[len[d]] = (unsigned char) automat[t].b.attr;
+        len[d + 1] = len[d] + 1;
+#endif
+        /* when string terminates at this character write the string */
+#ifdef USE_VALUES
+        sum[d + 1] = sum[d] + automat_value[t];
+        if (automat[t].b.term)
+            put_value(out, str, len[d + 1], sum[d + 1]);
+#else
+        if (automat[t].b.term)
+            put_string(out, str, len[d + 1]);
+#endif
+        if (automat[t].b.term)
+            out->shared = len[d + 1];   /* the next string extends it */
+
+        if (automat[t].b.dest)
+        {
+            /* descend to the next state */
+            if (++d > MAX_STR_LEN)
+                error("Error in automat file.");
+            state[d] = automat[t].b.dest;
+            trans[d] = first_trans(automat, state[d], &sorted[d]);
+        }
+        else
+        {
+            /* go to the next transition, leaving exhausted states */
+            while (d >= 0 && (trans[d] = next_trans(automat, state[d],
+                                                    trans[d], sorted[d])) == 0)
+                d--;
+            if (d >= 0 && out->shared > len[d])
+                out->shared = len[d];   /* the next string branches here */
+        }
+    }
+}
+
+/*
+** List the automaton to the lexicon file.
+*/
+void list_automat(void)
+{
+    out_buffer out;
+
+    start_buffer(&out, lex_file, LIST_BUF_SIZE, front_coded);
+
+#ifdef USE_VALUES
+    list_strings(start_state, (unsigned char *) "", 0, 0, &out);
+#else
+    list_strings(start_state, (unsigned char *) "", 0, &out);
+#endif
+    flush_buffer(&out);
+
+    n_strings += out.n_strings;
+    n_chars += out.n_chars;
+    free(out.data);
+}
+
+list_task *list_tasks;                  /* parts of the automaton */
+long list_n_tasks, list_max_tasks;
+volatile long list_next_task;
+volatile long list_turn;                /* task whose output goes next */
+out_buffer list_out[MAX_THREADS];       /* output of each thread */
+
+/*
+** Add a task listing from the transition t after a prefix of len
+** bytes (with value), and the strings below t if deep.
+*/
+#ifdef USE_VALUES
+void add_list_task(unsigned t, unsigned char *prefix, size_t len,
+                   unsigned value, int deep)
+#else
+void add_list_task(unsigned t, unsigned char *prefix, size_t len, int deep)
+#endif
+{
+    list_task *task;
+
+    if (list_n_tasks == list_max_tasks
+        && (list_tasks = (list_task *) realloc(list_tasks,
+                (list_max_tasks = 2 * list_max_tasks + MAX_CHARS)
+                * sizeof *list_tasks)) == NULL)
+        error("Not enough memory.");
+    task = &list_tasks[list_n_tasks++];
+    task->trans = t;
+    memcpy(task->prefix, prefix, len);
+    task->len = len;
+#ifdef USE_VALUES
+    task->value = value;
+#endif
+    task->deep = deep;
+}
+
+/*
+** Take tasks one by one and list their strings into the buffer
+** of the thread (arg). The buffer is written when full and at the
+** end of a task, each time waiting until the earlier tasks are
+** written, so the output keeps its order in bounded memory.
+*/
+THREAD_FUN(list_worker)
+{
+    out_buffer *out = (out_buffer *) arg;
+    unsigned char str[4 * 2 + 12];
+    list_task *task;
+    size_t len;
+    unsigned t;
+    long i;
+
+    while ((i = ATOMIC_NEXT(&list_next_task)) < list_n_tasks)
+    {
+        task = &list_tasks[i];
+        t = task->trans;
+        out->ticket = i;
+        memcpy(str, task->prefix, task->len);
+#ifdef USE_UTF8
+        len = task->len + encode_utf8(alphabet[automat[t].b.attr],
+                                      str + task->len);
+#else
+        str[task->len] = (unsigned char) automat[t].b.attr;
+        len = task->len + 1;
+#endif
+#ifdef USE_VALUES
+        if (automat[t].b.term)
+            put_value(out, str, len, task->value + automat_value[t]);
+        if (task->deep)
+            list_strings(automat[t].b.dest, str, len,
+                         task->value + automat_value[t], out);
+#else
+        if (automat[t].b.term)
+            put_string(out, str, len);
+        if (task->deep)
+            list_strings(automat[t].b.dest, str, len, out);
+#endif
+        flush_buffer(out);
+        MEMORY_BARRIER();
+        list_turn = i + 1;
+    }
+    return 0;
+}
+
+/*
+** List the automaton to the lexicon file using several threads.
+** The work is split at the second level of the automaton, since
+** a few initial letters hold most strings: each transition of the
+** start state is a task for its own string, and each transition
+** of the state it leads to lists the strings below it.
+*/
+void list_automat_parallel(void)
+{
+    thread_t threads[MAX_THREADS];
+    unsigned char prefix[8];
+    int n_threads, i, sorted, sorted_d;
+    size_t len;
+    unsigned t, u, d;
+
+    list_n_tasks = 0;
+    for (t = first_trans(automat, start_state, &sorted); t;
+         t = next_trans(automat, start_state, t, sorted))
+    {
+        if (t > aut_size || (d = automat[t].b.dest) > aut_size)
+            error("Error in automat file.");
+#ifdef USE_UTF8
+        len = encode_utf8(alphabet[automat[t].b.attr], prefix);
+#else
+        prefix[0] = (unsigned char) automat[t].b.attr;
+        len = 1;
+#endif
+#ifdef USE_VALUES
+        if (automat[t].b.term)
+            add_list_task(t, prefix, 0, 0, 0);
+        if (d)
+            for (u = first_trans(automat, d, &sorted_d); u;
+                 u = next_trans(automat, d, u, sorted_d))
+                add_list_task(u, prefix, len, automat_value[t], 1);
+#else
+        if (automat[t].b.term)
+            add_list_task(t, prefix, 0, 0);
+        if (d)
+            for (u = first_trans(automat, d, &sorted_d); u;
+                 u = next_trans(automat, d, u, sorted_d))
+                add_list_task(u, prefix, len, 1);
+#endif
+    }
+    list_next_task = 0;
+    list_turn = 0;
+
+    n_threads = count_cpus();
+    if (n_threads > list_n_tasks)
+        n_threads = list_n_tasks;
+    for (i = 0; i < n_threads; i++)
+    {
+        start_buffer(&list_out[i], lex_file, LIST_BUF_SIZE, 0);
+        list_out[i].turn = &list_turn;
+        start_thread(&threads[i], list_worker, &list_out[i]);
+    }
+    for (i = 0; i < n_threads; i++)
+    {
+        join_thread(threads[i]);
+        n_strings += list_out[i].n_strings;
+        n_chars += list_out[i].n_chars;
+        free(list_out[i].data);
+    }
+    free(list_tasks);
+    list_tasks = NULL;
+    list_max_tasks = 0;
+}
+
+/*
+** Start a new thread running fun(arg).
+*/
+void start_thread(thread_t *thread, thread_fun fun, void *arg)
+{
+#ifdef _WIN32
+    if ((*thread = CreateThread(NULL, 0, fun, arg, 0, NULL)) == NULL)
+#else
+    if (pthread_create(thread, NULL, fun, arg) != 0)
+#endif
+        error("Cannot create thread.");
+}
+
+/*
+** Wait for a thread to finish.
+*/
+void join_thread(thread_t thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/*
+** Return the number of processors, at least 1 and at most MAX_THREADS.
+*/
+int count_cpus(void)
+{
+    long n;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    n = info.dwNumberOfProcessors;
+#else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1)
+        n = 1;
+    return n < MAX_THREADS ? (int) n : MAX_THREADS;
+}
+
+/*
+** Check if a string belongs to the result of a set operation
+** given whether it belongs to the first and the second set.
+*/
+int in_result(int op, int in_a, int in_b)
+{
+    switch (op)
+    {
+    case 'u':
+        return in_a || in_b;
+    case 'i':
+        return in_a && in_b;
+    default:
+        return in_a && !in_b;
+    }
+}
+
+/*
+** Walk the state sa of set_a and the state sb of set_b in lockstep
+** (0 stands for a missing state) and add the strings of the result
+** that begin with the first len symbols of set_str to the automaton.
+** Subtrees that cannot contribute to the result are skipped.
+*/
+void combine_states(int op, unsigned sa, unsigned sb, size_t len)
+{
+    unsigned ta, tb, la, lb;
+    int term, sorted_a = 1, sorted_b = 1;
+
+    if (op == 'i' ? !sa || !sb : op == 's' ? !sa : !sa && !sb)
+        return;
+    if (len >= MAX_STR_LEN)
+        error("Error in automat file.");
+    if (sa > set_a.size || sb > set_b.size)
+        error("Error in automat file.");
+
+    ta = sa ? first_trans(set_a.trans, sa, &sorted_a) : 0;
+    tb = sb ? first_trans(set_b.trans, sb, &sorted_b) : 0;
+    while (ta || tb)
+    {
+        /* take the smaller label, or both if they are equal */
+        la = ta ? map_a[set_a.trans[ta].b.attr] : MAX_CHARS;
+        lb = tb ? map_b[set_b.trans[tb].b.attr] : MAX_CHARS;
+
+        set_str[len] = (unsigned char) (la < lb ? la : lb);
+        if (set_lcp > len)
+            set_lcp = len;
+        term = in_result(op, la <= lb && set_a.trans[ta].b.term,
+                         lb <= la && set_b.trans[tb].b.term);
+#ifdef USE_VALUES
+        set_value_a[len + 1] = set_value_a[len]
+                               + (la <= lb ? set_a.values[ta] : 0);
+        set_value_b[len + 1] = set_value_b[len]
+                               + (lb <= la ? set_b.values[tb] : 0);
+        /* a string of both sets keeps its value from set_a */
+        str_value = la <= lb && set_a.trans[ta].b.term ?
+                    set_value_a[len + 1] : set_value_b[len + 1];
+#endif
+        if (term)
+        {
+            add_string(set_str, len + 1, set_lcp);
+            set_lcp = len + 1;
+            n_strings++;
+            n_chars += len + 2;
+        }
+        combine_states(op, la <= lb ? set_a.trans[ta].b.dest : 0,
+                       lb <= la ? set_b.trans[tb].b.dest : 0, len + 1);
+
+        if (la <= lb)
+            ta = next_trans(set_a.trans, sa, ta, sorted_a);
+        if (lb <= la)
+            tb = next_trans(set_b.trans, sb, tb, sorted_b);
+    }
+}
+
+/*
+** Build the union ('u'), intersection ('i') or difference ('s')
+** of two automata read from files. Strings of the result come out
+** of the lockstep walk in order, so they go straight to the builder.
+*/
+void combine_automata(int op, char *name_a, char *name_b)
+{
+#ifndef USE_UTF8
+    int i;
+#endif
+
+    set_a.trans = NULL;
+    set_b.trans = NULL;
+#ifdef USE_VALUES
+    set_a.values = NULL;
+    set_b.values = NULL;
+#endif
+    load_automat(name_a, &set_a);
+    load_automat(name_b, &set_b);
+
+#ifdef USE_UTF8
+    merge_alphabets(set_a.alphabet, set_b.alphabet);
+#else
+    for (i = 0; i < MAX_CHARS; i++)
+        map_a[i] = map_b[i] = i;
+#endif
+
+    start_automat();
+    set_lcp = 0;
+#ifdef USE_VALUES
+    set_value_a[0] = set_value_b[0] = 0;
+#endif
+    combine_states(op, set_a.start, set_b.start, 0);
+    finish_automat();
+
+    free(set_a.trans);
+    free(set_b.trans);
+#ifdef USE_VALUES
+    free(set_a.values);
+    free(set_b.values);
+#endif
+}
+
+/*
+** Check if a pair of states is known to have equal languages.
+*/
+int find_pair(unsigned sa, unsigned sb)
+{
+    size_t h;
+
+    if (pair_size == 0)
+        return 0;
+    for (h = HASH_PAIR(sa, sb) & (pair_size - 1); pair_table[2 * h];
+         h = (h + 1) & (pair_size - 1))
+        if (pair_table[2 * h] == sa && pair_table[2 * h + 1] == sb)
+            return 1;
+    return 0;
+}
+
+/*
+** Remember a pair of states with equal languages.
+*/
+void add_pair(unsigned sa, unsigned sb)
+{
+    unsigned *old_table = pair_table;
+    size_t old_size = pair_size, h, i;
+
+    if (2 * (pair_count + 1) > pair_size)
+    {
+        /* grow the table and move the pairs */
+        pair_size = pair_size ? 2 * pair_size : 1024;
+        if ((pair_table = (unsigned *) calloc(2 * pair_size, sizeof(unsigned)))
+            == NULL)
+            error("Not enough memory.");
+        pair_count = 0;
+        for (i = 0; i < old_size; i++)
+            if (old_table[2 * i])
+                add_pair(old_table[2 * i], old_table[2 * i + 1]);
+        free(old_table);
+    }
+
+    for (h = HASH_PAIR(sa, sb) & (pair_size - 1); pair_table[2 * h];
+         h = (h + 1) & (pair_size - 1))
+        ;
+    pair_table[2 * h] = sa;
+    pair_table[2 * h + 1] = sb;
+    pair_count++;
+}
+
+/*
+** Walk the state sa of set_a (old) and the state sb of set_b (new)
+** in lockstep and write the strings found in only one of them,
+** marked with '-' or '+'. diff_str holds the mark and len bytes
+** of the current string. Pairs of states found equal are remembered,
+** so shared subgraphs are walked once. Return 1 if anything was
+** written.
+*/
+int diff_states(unsigned sa, unsigned sb, size_t depth, size_t len)
+{
+    unsigned ta, tb, la, lb;
+    int in_a, in_b, found = 0, sorted_a = 1, sorted_b = 1;
+    size_t new_len;
+
+    if (!sa && !sb)
+        return 0;
+    if (sa && sb && find_pair(sa, sb))
+        return 0;
+    if (depth >= MAX_STR_LEN)
+        error("Error in automat file.");
+    if (sa > set_a.size || sb > set_b.size)
+        error("Error in automat file.");
+
+    ta = sa ? first_trans(set_a.trans, sa, &sorted_a) : 0;
+    tb = sb ? first_trans(set_b.trans, sb, &sorted_b) : 0;
+    while (ta || tb)
+    {
+        la = ta ? map_a[set_a.trans[ta].b.attr] : MAX_CHARS;
+        lb = tb ? map_b[set_b.trans[tb].b.attr] : MAX_CHARS;
+
+#ifdef USE_UTF8
+        new_len = len + encode_utf8(alphabet[la < lb ? la : lb],
+                                    diff_str + 1 + len);
+#else
+        diff_str[1 + len] = (unsigned char) (la < lb ? la : lb);
+        new_len = len + 1;
+#endif
+        in_a = la <= lb && set_a.trans[ta].b.term;
+        in_b = lb <= la && set_b.trans[tb].b.term;
+        if (in_a != in_b)
+        {
+            diff_str[0] = in_a ? '-' : '+';
+            put_string(&diff_out, diff_str, new_len + 1);
+            if (in_a)
+                n_removed++;
+            else
+                n_added++;
+            found = 1;
+        }
+        found |= diff_states(la <= lb ? set_a.trans[ta].b.dest : 0,
+                             lb <= la ? set_b.trans[tb].b.dest : 0,
+                             depth + 1, new_len);
+
+        if (la <= lb)
+            ta = next_trans(set_a.trans, sa, ta, sorted_a);
+        if (lb <= la)
+            tb = next_trans(set_b.trans, sb, tb, sorted_b);
+    }
+
+    if (!found && sa && sb)
+        add_pair(sa, sb);
+    return found;
+}
+
+/*
+** Write to the lexicon file the strings removed from (marked '-')
+** and added to (marked '+') the automaton name_a to get name_b.
+*/
+void diff_automata(char *name_a, char *name_b)
+{
+#ifndef USE_UTF8
+    int i;
+#endif
+
+    set_a.trans = NULL;
+    set_b.trans = NULL;
+#ifdef USE_VALUES
+    set_a.values = NULL;
+    set_b.values = NULL;
+#endif
+    load_automat(name_a, &set_a);
+    load_automat(name_b, &set_b);
+
+#ifdef USE_UTF8
+    merge_alphabets(set_a.alphabet, set_b.alphabet);
+#else
+    for (i = 0; i < MAX_CHARS; i++)
+        map_a[i] = map_b[i] = i;
+#endif
+
+    start_buffer(&diff_out, lex_file, LIST_BUF_SIZE, 0);
+
+    n_added = n_removed = 0;
+    diff_states(set_a.start, set_b.start, 0, 0);
+    flush_buffer(&diff_out);
+    printf("%lu strings removed\t%lu strings added\n", n_removed, n_added);
+    n_strings += diff_out.n_strings;
+    n_chars += diff_out.n_chars;
+
+    free(diff_out.data);
+    free(pair_table);
+    pair_table = NULL;
+    pair_size = pair_count = 0;
+    free(set_a.trans);
+    free(set_b.trans);
+#ifdef USE_VALUES
+    free(set_a.values);
+    free(set_b.values);
+#endif
+}
+
+/*
+** Hash function for strings.
+*/
+size_t hash_string(unsigned char *str)
+{
+    size_t h = 2166136261u;
+
+    while (*str)
+        h = (h ^ *str++) * 16777619u;
+    return h;
+}
+
+/*
+** Find the slot of the delta that holds str (without the mark)
+** or the free slot where it belongs.
+*/
+unsigned char **delta_find(delta *d, unsigned char *str)
+{
+    size_t h;
+
+    for (h = hash_string(str) & (d->size - 1); d->slot[h];
+         h = (h + 1) & (d->size - 1))
+        if (!strcmp((char *) d->slot[h] + 1, (char *) str))
+            break;
+    return &d->slot[h];
+}
+
+/*
+** Record in the delta a marked string: "+s" adds s, "-s" removes it.
+** A later change of the same string replaces the earlier one.
+*/
+void delta_put(delta *d, unsigned char *line)
+{
+    unsigned char **old_slot = d->slot, **p;
+    size_t old_size = d->size, i;
+
+    if (2 * (d->count + 1) > d->size)
+    {
+        /* grow the table and move the strings */
+        d->size = d->size ? 2 * d->size : 1024;
+        if ((d->slot = (unsigned char **) calloc(d->size, sizeof *d->slot))
+            == NULL)
+            error("Not enough memory.");
+        for (i = 0; i < old_size; i++)
+            if (old_slot[i])
+                *delta_find(d, old_slot[i] + 1) = old_slot[i];
+        free(old_slot);
+    }
+
+    p = delta_find(d, line + 1);
+    if (*p)
+        (*p)[0] = line[0];
+    else
+    {
+        if ((*p = (unsigned char *) malloc(strlen((char *) line) + 1)) == NULL)
+            error("Not enough memory.");
+        strcpy((char *) *p, (char *) line);
+        d->count++;
+    }
+}
+
+/*
+** Free the strings of the delta and empty it.
+*/
+void delta_free(delta *d)
+{
+    size_t i;
+
+    for (i = 0; i < d->size; i++)
+        free(d->slot[i]);
+    free(d->slot);
+    d->slot = NULL;
+    d->size = d->count = 0;
+}
+
+#ifdef USE_UTF8
+/*
+** Return the symbol of code point c in the alphabet codes, or 0.
+*/
+unsigned find_symbol(unsigned *codes, unsigned c)
+{
+    unsigned lo = 1, hi = MAX_CHARS, mid;
+
+    /* unused entries (0) sort after all code points */
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (codes[mid] && codes[mid] < c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < MAX_CHARS && codes[lo] == c ? lo : 0;
+}
+#endif
+
+/*
+** Check if the automaton a (not the global one) contains str.
+*/
+int find_string(automaton *a, unsigned char *str)
+{
+    unsigned pos = a->start, t = 0, w;
+    int sorted;
+
+    while (*str)
+    {
+#ifdef USE_UTF8
+        if ((w = find_symbol(a->alphabet, decode_utf8(&str))) == 0)
+            return 0;
+#else
+        w = *str++;
+#endif
+        for (t = pos ? first_trans(a->trans, pos, &sorted) : 0;
+             t && a->trans[t].b.attr != w;
+             t = next_trans(a->trans, pos, t, sorted))
+            if (t >= a->size)
+                error("Error in automaton file.");
+        if (!t)
+            return 0;
+        pos = a->trans[t].b.dest;
+    }
+    return t && a->trans[t].b.term;
+}
+
+/*
+** Start a walk over the strings of the automaton a in order.
+*/
+void walk_start(walker *w, automaton *a)
+{
+    w->aut = a;
+    w->len[0] = 0;
+    w->state[0] = a->start;
+    w->trans[0] = a->start ? first_trans(a->trans, a->start, &w->sorted[0])
+                           : 0;
+    w->depth = w->trans[0] ? 0 : -1;
+}
+
+/*
+** Put the next string of the walk into w->str (encoded, like
+** list_strings writes it) and return its length, or 0 at the end.
+*/
+size_t walk_next(walker *w)
+{
+    automaton *a = w->aut;
+    unsigned t;
+    size_t len;
+    int d;
+
+    while ((d = w->depth) >= 0)
+    {
+        t = w->trans[d];
+        if (t >= a->size)
+            error("Error in automaton file.");
+#ifdef USE_UTF8
+        len = w->len[d] + encode_utf8(a->alphabet[a->trans[t].b.attr],
+                                      w->str + w->len[d]);
+#else
+        w->str[w->len[d]] = (unsigned char) a->trans[t].b.attr;
+        len = w->len[d] + 1;
+#endif
+        w->len[d + 1] = len;
+
+        /* move on before returning the string */
+        if (a->trans[t].b.dest)
+        {
+            if (++d > MAX_STR_LEN)
+                error("Error in automaton file.");
+            w->state[d] = a->trans[t].b.dest;
+            w->trans[d] = first_trans(a->trans, w->state[d], &w->sorted[d]);
+        }
+        else
+            while (d >= 0 && (w->trans[d] = next_trans(a->trans, w->state[d],
+                                                       w->trans[d],
+                                                       w->sorted[d])) == 0)
+                d--;
+        w->depth = d;
+
+        if (a->trans[t].b.term)
+        {
+            w->str[len] = '\0';
+            return len;
+        }
+    }
+    return 0;
+}
+
+/*
+** Compare two marked strings, ignoring the marks.
+*/
+int compare_marked(const void *a, const void *b)
+{
+    return strcmp(*(char **) a + 1, *(char **) b + 1);
+}
+
+/*
+** Build in the global automaton the strings of base changed
+** by the delta d, which is read but not changed, and copy the
+** result to a new automaton. Both inputs come out in order, so
+** they are merged straight into the builder as by make_automat.
+*/
+void merge_delta(automaton *base, delta *d, automaton *result)
+{
+    unsigned char **sorted, *str, s1[MAX_STR_LEN + 1];
+    walker *w;
+    size_t i, n = 0, len, p, q;
+    int cmp;
+#ifdef USE_UTF8
+    static unsigned char used[MAX_CODE_POINT / 8];
+    unsigned codes[MAX_CHARS], c, k = 1;
+#endif
+
+    if ((sorted = (unsigned char **) malloc((d->count + 1) * sizeof *sorted))
+        == NULL || (w = (walker *) malloc(sizeof *w)) == NULL)
+        error("Not enough memory.");
+    for (i = 0; i < d->size; i++)
+        if (d->slot[i])
+            sorted[n++] = d->slot[i];
+    qsort(sorted, n, sizeof *sorted, compare_marked);
+
+#ifdef USE_UTF8
+    /* the new alphabet has the characters of the added strings too */
+    for (i = 0; i < n; i++)
+        if (sorted[i][0] == '+')
+            for (str = sorted[i] + 1; *str; )
+            {
+                if ((c = decode_utf8(&str)) == MAX_CODE_POINT)
+                    error("Malformed UTF-8 string in the lexicon.");
+                used[c >> 3] |= 1 << (c & 7);
+            }
+    for (c = 1; c < MAX_CODE_POINT; c++)
+        if (used[c >> 3] & (1 << (c & 7)))
+        {
+            used[c >> 3] &= ~(1 << (c & 7));
+            if (k == MAX_CHARS)
+                error("Too many different characters in the lexicon.");
+            codes[k++] = c;
+        }
+    for (codes[0] = 0; k < MAX_CHARS; k++)
+        codes[k] = 0;
+    merge_alphabets(base->alphabet, codes);
+#endif
+
+    start_automat();
+    walk_start(w, base);
+    len = walk_next(w);
+    i = 0;
+    while (len || i < n)
+    {
+        /* take the smaller string; a change wins over the base */
+        if (!len)
+            cmp = 1;
+        else if (i == n)
+            cmp = -1;
+        else
+            cmp = strcmp((char *) w->str, (char *) sorted[i] + 1);
+        if (cmp < 0)
+            str = w->str;
+        else if (sorted[i][0] == '+')
+            str = sorted[i] + 1;
+        else
+            str = NULL;
+
+        if (str)
+        {
+            strcpy((char *) s1, (char *) str);
+            q = strlen((char *) s1);
+#ifdef USE_UTF8
+            q = decode_string(s1);
+#endif
+            for (p = 0; p < q && s1[p] == last_str[p]; p++)
+                ;
+            add_string(s1, q, p);
+        }
+        if (cmp <= 0)
+            len = walk_next(w);
+        if (cmp >= 0)
+            i++;
+    }
+    finish_automat();
+    free_tables();
+    free(sorted);
+    free(w);
+
+    /* copy the automaton, with the pseudo state, as load_automat would */
+    result->size = aut_size;
+    result->start = start_state;
+    if ((result->trans = (transition *)
+         malloc((aut_size + 1) * sizeof(transition))) == NULL)
+        error("Not enough memory.");
+    memcpy(result->trans, automat, (aut_size + 1) * sizeof(transition));
+    result->trans[0].b.dest = start_state;
+#ifdef USE_UTF8
+    memcpy(result->alphabet, alphabet, sizeof result->alphabet);
+#endif
+}
+
+automaton tier_base;                /* the immutable base automaton */
+automaton tier_next;                /* the base being merged */
+delta tier_delta;                   /* recent changes */
+delta tier_frozen;                  /* changes being merged */
+int tier_merging;                   /* is a merge running */
+volatile long tier_merged;          /* has it finished */
+thread_t tier_thread;
+
+/*
+** Merge the frozen delta into a new base in the background.
+*/
+THREAD_FUN(merge_worker)
+{
+    (void) arg;
+    merge_delta(&tier_base, &tier_frozen, &tier_next);
+    tier_merged = 1;
+    return 0;
+}
+
+/*
+** Freeze the current delta and start merging it.
+*/
+void start_merge(void)
+{
+    tier_frozen = tier_delta;
+    tier_delta.slot = NULL;
+    tier_delta.size = tier_delta.count = 0;
+    tier_merged = 0;
+    tier_merging = 1;
+    start_thread(&tier_thread, merge_worker, NULL);
+}
+
+/*
+** Wait for the merge and make its result the base.
+*/
+void finish_merge(void)
+{
+    join_thread(tier_thread);
+    free(tier_base.trans);
+    tier_base = tier_next;
+    delta_free(&tier_frozen);
+    tier_merging = 0;
+}
+
+/*
+** Check if a string is in the tiered automaton: the newest
+** change of the string decides, and without one the base.
+*/
+int tiered_check(unsigned char *str)
+{
+    unsigned char **p;
+
+    if (tier_delta.count && *(p = delta_find(&tier_delta, str)))
+        return (*p)[0] == '+';
+    if (tier_merging && *(p = delta_find(&tier_frozen, str)))
+        return (*p)[0] == '+';
+    return find_string(&tier_base, str);
+}
+
+/*
+** Run the commands of the lexicon file on the automaton read from
+** aut_name: "+s" adds s, "-s" removes it and "?s" writes s to
+** out_name marked with + or -, as it is in the automaton or not.
+** Changes go to an in-memory delta and lookups see them at once;
+** full deltas of DELTA_SIZE changes are merged into a new base by
+** a background thread, so lookups do not wait for it. A merge is
+** a full rebuild of the base, costing its size for every DELTA_SIZE
+** changes. Only one delta is merged at a time: when the next one
+** fills up first, changes wait for the merge, which keeps the delta
+** bounded. The final base is saved.
+*/
+void tiered_automat(char *aut_name, char *out_name)
+{
+    unsigned char s1[MAX_STR_LEN + 1];
+    out_buffer out;
+    FILE *file;
+    size_t q;
+
+    tier_base.trans = NULL;
+    load_automat(aut_name, &tier_base);
+
+    if ((file = fopen(out_name, "wb")) == NULL)
+        error("Cannot open output file.");
+    start_buffer(&out, file, LIST_BUF_SIZE, 0);
+
+    while ((q = read_string(s1)) != 0)
+    {
+        if (tier_merging && tier_merged)
+            finish_merge();
+        switch (s1[0])
+        {
+        case '+':
+        case '-':
+            if (q > 1)
+                delta_put(&tier_delta, s1);
+            if (tier_delta.count >= DELTA_SIZE)
+            {
+                if (tier_merging)
+                    finish_merge();     /* the merge is behind */
+                start_merge();
+            }
+            break;
+        case '?':
+            s1[0] = tiered_check(s1 + 1) ? '+' : '-';
+            put_string(&out, s1, q);
+            break;
+        default:
+            error("Lines of the command file must begin with +, - or ?.");
+        }
+    }
+    flush_buffer(&out);
+    fclose(out.file);
+    free(out.data);
+
+    /* merge the rest and save the base */
+    if (tier_merging)
+        finish_merge();
+    if (tier_delta.count)
+    {
+        start_merge();
+        finish_merge();
+        save_automat(aut_name);
+    }
+    else if (tier_merged)
+        save_automat(aut_name);
+    free(tier_base.trans);
+}
+
+/*
+** Load an automaton into newly allocated memory.
+*/
+automaton *load_image(char *fname)
+{
+    automaton *a;
+
+    if ((a = (automaton *) malloc(sizeof *a)) == NULL)
+        error("Not enough memory.");
+    a->trans = NULL;
+#ifdef USE_VALUES
+    a->values = NULL;
+#endif
+    load_automat(fname, a);
+    return a;
+}
+
+/*
+** Free an automaton made by load_image.
+*/
+void free_image(automaton *a)
+{
+    free(a->trans);
+#ifdef USE_VALUES
+    free(a->values);
+#endif
+    free(a);
+}
+
+/*
+** Start reading the published automaton. Readers never wait;
+** the automaton returned stays valid until leave_reader.
+*/
+automaton *enter_reader(reloadable *h, int reader)
+{
+    h->reader[reader] = h->epoch;
+    MEMORY_BARRIER();           /* announce the epoch before reading */
+    return h->image;
+}
+
+/*
+** Finish reading the automaton.
+*/
+void leave_reader(reloadable *h, int reader)
+{
+    MEMORY_BARRIER();           /* finish the reads before leaving */
+    h->reader[reader] = 0;
+}
+
+/*
+** Load a new automaton from fname on the side, publish it with
+** a single pointer swap and free the old one when no reader that
+** could have seen it is left (epoch-based reclamation).
+*/
+void reload_automat(reloadable *h, char *fname)
+{
+    automaton *old;
+    long epoch;
+    int i;
+
+    old = (automaton *) ATOMIC_SWAP(&h->image, load_image(fname));
+    epoch = ATOMIC_NEXT(&h->epoch) + 1;
+
+    /* readers that announced an older epoch may still use old */
+    for (i = 0; i < MAX_THREADS; i++)
+        while (h->reader[i] && h->reader[i] < epoch)
+            YIELD();
+    free_image(old);
+}
+
+reloadable reload_handle;
+out_buffer reload_strings;          /* strings to look up, 0-separated */
+volatile long reload_done;          /* number of readers finished */
+unsigned long reload_found[MAX_THREADS];
+unsigned long reload_lookups[MAX_THREADS];
+
+/*
+** Look up all the strings a few times in whatever automaton
+** is published at the moment.
+*/
+THREAD_FUN(reload_reader)
+{
+    int id = (int) (size_t) arg, round;
+    unsigned char *p, *end = reload_strings.data + reload_strings.len;
+    automaton *a;
+
+    for (round = 0; round < RELOAD_ROUNDS; round++)
+        for (p = reload_strings.data; p < end; p += strlen((char *) p) + 1)
+        {
+            a = enter_reader(&reload_handle, id);
+            reload_found[id] += find_string(a, p);
+            leave_reader(&reload_handle, id);
+            reload_lookups[id]++;
+        }
+    ATOMIC_NEXT(&reload_done);
+    return 0;
+}
+
+/*
+** Look up the strings of the lexicon file in several threads
+** while the automaton is reloaded from aut_name over and over.
+*/
+void reload_test(char *aut_name)
+{
+    thread_t threads[MAX_THREADS];
+    unsigned char s1[MAX_STR_LEN + 1];
+    unsigned long lookups = 0, found = 0, reloads = 0;
+    size_t q, i;
+    int n_threads, j;
+
+    start_buffer(&reload_strings, NULL, LIST_BUF_SIZE, 0);
+    while ((q = read_string(s1)) != 0)
+        put_string(&reload_strings, s1, q);
+    for (i = 0; i < reload_strings.len; i++)
+        if (reload_strings.data[i] == '\n')
+            reload_strings.data[i] = '\0';
+
+    reload_handle.epoch = 1;
+    reload_handle.image = load_image(aut_name);
+    reload_done = 0;
+
+    n_threads = count_cpus();
+    for (j = 0; j < n_threads; j++)
+        start_thread(&threads[j], reload_reader, (void *) (size_t) j);
+    while (reload_done < n_threads)
+    {
+        reload_automat(&reload_handle, aut_name);
+        reloads++;
+    }
+    for (j = 0; j < n_threads; j++)
+    {
+        join_thread(threads[j]);
+        lookups += reload_lookups[j];
+        found += reload_found[j];
+    }
+
+    printf("%lu lookups\t%lu strings not found\t%lu reloads\n",
+           lookups, lookups - found, reloads);
+    free_image(reload_handle.image);
+    free(reload_strings.data);
+}
+
+/*
+** Show some statistics, including execution time.
+*/
+void show_stat(double exec_time)
+{
+    printf("%lu strings\t%lu characters\n", n_strings, n_chars);
+#ifdef PRINT_STATISTICS
+    printf("%u states\t%u transitions\t%u terminal transitions\n",
+           n_states, n_trans, n_term_trans);
+#ifdef USE_INCLUSION
+    printf("%u included states\t%u included transitions\n",
+           n_states_in, n_trans_in);
+#endif
+#endif
+#ifdef USE_UTF8
+    printf("%u symbols in the alphabet\t%lu symbols in strings\n",
+           alphabet_size - 1, n_symbols);
+#endif
+    printf("Execution time: %.3f seconds\t", exec_time);
+    if (exec_time != 0.0)
+    {
+        printf("\nExecution speed: %.lf wps, %.lf cps\n",
+               n_strings / exec_time, n_chars / exec_time);
+    }
+    printf("Size of the automaton: %lu bytes\n",
+           (unsigned long) aut_size * (sizeof automat[0]
+#ifdef USE_VALUES
+                                       + sizeof automat_value[0]
+#endif
+                                       ));
+    if (bloom_filter != NULL)
+        printf("Size of the filter: %u bytes\n",
+               bloom_blocks * BLOOM_BLOCK * (unsigned) sizeof bloom_filter[0]);
+    if (pack_data != NULL)
+    {
+        printf("Size of the packed automaton: %lu bytes in %u blocks\n",
+               (unsigned long) (4 + pack_dict_size + pack_blocks + 1)
+               * sizeof(unsigned) + pack_index[pack_blocks], pack_blocks);
+        if (pack_hits + pack_misses != 0)
+            printf("Blocks unpacked: %lu\tfound in the cache: %lu\t"
+                   "cache size: %lu bytes\n", pack_misses, pack_hits,
+                   (unsigned long) sizeof pack_cache
+#ifdef USE_VALUES
+                   + (unsigned long) sizeof pack_cache_value
+#endif
+                   );
+    }
+}
+
+/*
+** Read an automaton from a file fname into a. If a->trans (or a->values)
+** is NULL, memory for the transitions (or their outputs) is allocated.
+*/
+void load_automat(char *fname, automaton *a)
+{
+    long size;
+    unsigned first;
+
+    if ((aut_file = fopen(fname, "rb")) == NULL)
+        error("Cannot open input file.");
+    if (fseek(aut_file, 0, SEEK_END) != 0 || (size = ftell(aut_file)) < 0)
+        error("Error in input file.");
+    rewind(aut_file);
+    if (fread(&first, sizeof first, 1, aut_file) < 1)
+        error("Error in input file.");
+
+    /* the filter (probes, number of words) and the jump table */
+    /* (its outputs, number of entries) are skipped */
+    size /= sizeof(transition);
+    if ((a->bloom = first >> BLOOM_SHIFT & 1) != 0)
+        size = skip_trailer(size, 1, 2);
+    if ((a->jump_depth = first >> JUMP_SHIFT & 3) != 0)
+#ifdef USE_VALUES
+        size = skip_trailer(size, 2, 1);
+#else
+        size = skip_trailer(size, 1, 1);
+#endif
+    rewind(aut_file);
+
+    /* the transitions are followed by their outputs and the alphabet */
+#ifdef USE_UTF8
+    size -= MAX_CHARS;
+#endif
+#ifdef USE_VALUES
+    size /= 2;
+#endif
+    if (size < 1 || size > MAX_AUT_SIZE)
+        error("Error in input file.");
+
+    if (a->trans == NULL
+        && (a->trans = (transition *) malloc((size + 1) * sizeof(transition)))
+        == NULL)
+        error("Not enough memory.");
+#ifdef USE_VALUES
+    if (a->values == NULL
+        && (a->values = (unsigned *) malloc((size + 1) * sizeof(unsigned))) == NULL)
+        error("Not enough memory.");
+#endif
+    a->size = (unsigned) size;
+    if (fread(a->trans, sizeof(transition), a->size, aut_file) < a->size
+#ifdef USE_VALUES
+        || fread(a->values, sizeof(unsigned), a->size, aut_file) < a->size
+#endif
+#ifdef USE_UTF8
+        || fread(a->alphabet, sizeof a->alphabet[0], MAX_CHARS, aut_file)
+           < MAX_CHARS
+#endif
+        )
+        error("Error in input file.");
+    fclose(aut_file);
+
+    /* create a pseudo state pointing to the start state */
+    if (a->trans[0].all_fields >> LAYOUT_SHIFT != 0
+        && a->trans[0].all_fields >> LAYOUT_SHIFT != LAYOUT)
+        error("The automaton file has another layout of states.");
+    a->start = a->trans[0].all_fields & ((1u << BLOOM_SHIFT) - 1);
+    a->trans[0].all_fields = 0;
+    a->trans[0].b.dest = a->start;
+    if (a->start >= a->size)
+        error("Error in input file.");
+}
+
+/*
+** Read an automaton from a file fname.
+*/
+void read_automat(char *fname)
+{
+    automaton a;
+
+    a.trans = automat;
+#ifdef USE_VALUES
+    a.values = automat_value;
+#endif
+    load_automat(fname, &a);
+    aut_size = a.size;
+    start_state = a.start;
+#ifdef USE_UTF8
+    use_alphabet(a.alphabet);
+#endif
+    if (a.jump_depth)
+        read_jump_table(fname, a.jump_depth);
+    if (a.bloom)
+        read_bloom_filter(fname);
+}
+
+/*
+** Return the size in words of the beginning of the automaton file
+** that ends where a part of the file of given size begins. The part
+** ends with extra words, the last of which tells how many entries
+** of entry_size words precede them.
+*/
+long skip_trailer(long size, unsigned entry_size, unsigned extra)
+{
+    unsigned entries;
+
+    if (size < 1 || fseek(aut_file, (size - 1) * (long) sizeof entries,
+                          SEEK_SET) != 0
+        || fread(&entries, sizeof entries, 1, aut_file) < 1
+        || (unsigned long) size
+           <= (unsigned long) entries * entry_size + extra)
+        error("Error in input file.");
+    return size - (long) entries * entry_size - extra;
+}
+
+/*
+** Read the jump table of given depth saved after the automaton
+** in fname (see save_automat).
+*/
+void read_jump_table(char *fname, int depth)
+{
+    long offset = (long) aut_size * sizeof(transition);
+    unsigned entries;
+
+#ifdef USE_VALUES
+    offset *= 2;
+#endif
+#ifdef USE_UTF8
+    offset += MAX_CHARS * sizeof alphabet[0];
+    jump_radix = alphabet_size;
+#else
+    jump_radix = MAX_CHARS;
+#endif
+    for (jump_size = 1, jump_depth = 0; jump_depth < depth; jump_depth++)
+        jump_size *= jump_radix;
+
+    free(jump_table);
+    if ((jump_table = (unsigned *) malloc(jump_size * sizeof *jump_table))
+        == NULL)
+        error("Not enough memory.");
+#ifdef USE_VALUES
+    free(jump_value);
+    if ((jump_value = (unsigned *) malloc(jump_size * sizeof *jump_value))
+        == NULL)
+        error("Not enough memory.");
+#endif
+    if ((aut_file = fopen(fname, "rb")) == NULL)
+        error("Cannot open input file.");
+    if (fseek(aut_file, offset, SEEK_SET) != 0
+        || fread(jump_table, sizeof *jump_table, jump_size, aut_file)
+           < jump_size
+#ifdef USE_VALUES
+        || fread(jump_value, sizeof *jump_value, jump_size, aut_file)
+           < jump_size
+#endif
+        || fread(&entries, sizeof entries, 1, aut_file) < 1
+        || entries != jump_size)
+        error("Error in input file.");
+    fclose(aut_file);
+}
+
+/*
+** Make a jump table of depth new_jump_depth: for each string of that
+** many symbols, the transition reached by it, or 0. An entry takes the
+** symbols as digits of the base jump_radix.
+*/
+void make_jump_table(void)
+{
+#ifdef USE_UTF8
+    jump_radix = alphabet_size;
+#else
+    jump_radix = MAX_CHARS;
+#endif
+    for (jump_size = 1, jump_depth = 0; jump_depth < new_jump_depth;
+         jump_depth++)
+        jump_size *= jump_radix;
+
+    free(jump_table);
+    if ((jump_table = (unsigned *) calloc(jump_size, sizeof *jump_table))
+        == NULL)
+        error("Not enough memory.");
+#ifdef USE_VALUES
+    free(jump_value);
+    if ((jump_value = (unsigned *) calloc(jump_size, sizeof *jump_value))
+        == NULL)
+        error("Not enough memory.");
+#endif
+    if (start_state)
+        fill_jump_table(start_state, 1, 0, 0);
+}
+
+/*
+** Put the transitions of the state at pos, reached by the symbols
+** making up index with the outputs adding up to value, into the
+** jump table, or go deeper if they are not depth symbols long yet.
+*/
+void fill_jump_table(unsigned pos, int depth, size_t index, unsigned value)
+{
+    unsigned t, v = value;
+    size_t i;
+    int sorted;
+
+    for (t = first_trans(automat, pos, &sorted); t;
+         t = next_trans(automat, pos, t, sorted))
+    {
+        i = index * jump_radix + automat[t].b.attr;
+#ifdef USE_VALUES
+        v = value + automat_value[t];
+#endif
+        if (depth == jump_depth)
+        {
+            jump_table[i] = t;
+#ifdef USE_VALUES
+            jump_value[i] = v;
+#endif
+        }
+        else if (automat[t].b.dest)
+            fill_jump_table(automat[t].b.dest, depth + 1, i, v);
+    }
+}
+
+/*
+** Return the entry of the jump table for the first jump_depth symbols
+** of str and move str past them, or JUMP_NONE if str is shorter.
+** A character missing from the alphabet gives entry 0, which is
+** empty, as no transition has symbol 0.
+*/
+size_t jump_index(unsigned char **str)
+{
+    unsigned char *p = *str;
+    size_t index = 0;
+    unsigned s;
+    int d;
+
+    for (d = 0; d < jump_depth; d++)
+    {
+        if (*p == '\0')
+            return JUMP_NONE;
+        if ((s = NEXT_SYMBOL(p)) >= jump_radix)
+            return 0;
+        index = index * jump_radix + s;
+    }
+    *str = p;
+    return index;
+}
+
+/*
+** Hash a string for the filter: FNV-1a over its bytes, then mixed
+** like in MurmurHash3, as the filter takes the block from the low
+** bits and the probes from the high ones.
+*/
+unsigned bloom_hash(unsigned char *str)
+{
+    unsigned h = BLOOM_BASIS;
+
+    while (*str)
+        h = (h ^ *str++) * BLOOM_PRIME;
+    return bloom_mix(h);
+}
+
+/*
+** Finish a hash made by bloom_hash.
+*/
+unsigned bloom_mix(unsigned h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    return h ^ h >> 16;
+}
+
+/*
+** Set (or, if set is 0, check) the bits of a string of given hash in
+** the filter. All of them lie in one block, a cache line long; the
+** probes step through it by an odd stride. Return 0 if a bit was clear.
+*/
+int bloom_probe(unsigned h, int set)
+{
+    unsigned *block = bloom_filter + h % bloom_blocks * BLOOM_BLOCK;
+    unsigned g = h * 0x9e3779b9u;
+    unsigned bit = g >> 23, step = (g >> 14 & 511) | 1, i;
+
+    for (i = 0; i < bloom_probes; i++, bit = (bit + step) & 511)
+    {
+        if (set)
+            block[bit >> 5] |= 1u << (bit & 31);
+        else if (!(block[bit >> 5] & 1u << (bit & 31)))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+** Make a filter of new_bloom_bits bits per string of the automaton,
+** walking it like list_strings but keeping only the hash of the
+** string at each depth.
+*/
+void make_bloom_filter(void)
+{
+    unsigned state[MAX_STR_LEN + 2];    /* state at each depth */
+    unsigned trans[MAX_STR_LEN + 2];    /* current transition at each depth */
+    int sorted[MAX_STR_LEN + 2];        /* the state is in label order */
+    unsigned hash[MAX_STR_LEN + 3];     /* hash up to each depth */
+    unsigned *hashes = NULL, t, h;
+    size_t n = 0, size = 0, i;
+    unsigned char c[4];
+    int d = -1, len, j;
+
+    if (start_state)
+    {
+        d = 0;
+        state[0] = start_state;
+        trans[0] = first_trans(automat, start_state, &sorted[0]);
+        hash[0] = BLOOM_BASIS;
+    }
+    while (d >= 0)
+    {
+        t = trans[d];
+#ifdef USE_UTF8
+        len = encode_utf8(alphabet[automat[t].b.attr], c);
+#else
+        c[0] = (unsigned char) automat[t].b.attr;
+        len = 1;
+#endif
+        for (h = hash[d], j = 0; j < len; j++)
+            h = (h ^ c[j]) * BLOOM_PRIME;
+        hash[d + 1] = h;
+
+        if (automat[t].b.term)
+        {
+            if (n == size
+                && (hashes = (unsigned *) realloc(hashes, (size = 2 * size
+                    + 1024) * sizeof *hashes)) == NULL)
+                error("Not enough memory.");
+            hashes[n++] = bloom_mix(h);
+        }
+        if (automat[t].b.dest)
+        {
+            if (++d > MAX_STR_LEN)
+                error("Error in automat file.");
+            state[d] = automat[t].b.dest;
+            trans[d] = first_trans(automat, state[d], &sorted[d]);
+        }
+        else
+            while (d >= 0 && (trans[d] = next_trans(automat, state[d],
+                                                    trans[d], sorted[d])) == 0)
+                d--;
+    }
+
+    /* about 0.7 probes per bit of a string give the fewest */
+    /* false positives */
+    bloom_blocks = (unsigned) ((n * new_bloom_bits + 511) / 512);
+    if (bloom_blocks == 0)
+        bloom_blocks = 1;
+    if ((bloom_probes = (new_bloom_bits * 7 + 5) / 10) == 0)
+        bloom_probes = 1;
+    free(bloom_filter);
+    if ((bloom_filter = (unsigned *) calloc(bloom_blocks * BLOOM_BLOCK,
+                                            sizeof *bloom_filter)) == NULL)
+        error("Not enough memory.");
+    for (i = 0; i < n; i++)
+        bloom_probe(hashes[i], 1);
+    free(hashes);
+}
+
+/*
+** Read the filter saved at the end of fname (see save_automat).
+*/
+void read_bloom_filter(char *fname)
+{
+    unsigned tail[2];           /* probes and number of words */
+
+    if ((aut_file = fopen(fname, "rb")) == NULL)
+        error("Cannot open input file.");
+    if (fseek(aut_file, -(long) sizeof tail, SEEK_END) != 0
+        || fread(tail, sizeof tail[0], 2, aut_file) < 2
+        || tail[1] == 0 || tail[1] % BLOOM_BLOCK != 0)
+        error("Error in input file.");
+    bloom_probes = tail[0];
+    bloom_blocks = tail[1] / BLOOM_BLOCK;
+    free(bloom_filter);
+    if ((bloom_filter = (unsigned *) malloc(tail[1] * sizeof *bloom_filter))
+        == NULL)
+        error("Not enough memory.");
+    if (fseek(aut_file, -(long) ((tail[1] + 2) * sizeof tail[0]), SEEK_END)
+        != 0
+        || fread(bloom_filter, sizeof *bloom_filter, tail[1], aut_file)
+           < tail[1])
+        error("Error in input file.");
+    fclose(aut_file);
+}
+
+#ifdef PRINT_STATISTICS
+/*
+** Read up to TUNE_QUERIES strings of the lexicon file again and look
+** them up with and without the filter. Print how many misses the
+** filter stops, how many it lets through, and the lookup speed of
+** misses and hits both ways.
+*/
+void bloom_stat(void)
+{
+    static size_t offset[TUNE_QUERIES];     /* of each string in text */
+    static char found[TUNE_QUERIES];
+#ifdef USE_VALUES
+    static unsigned value[TUNE_QUERIES];
+#endif
+    unsigned char *text;
+    size_t size = 1 << 16, used = 0, n = 0, i, len;
+    unsigned long count[2], stopped = 0;
+    unsigned long strings = n_strings, chars = n_chars;
+    unsigned *filter = bloom_filter;
+    double time[2][2];          /* [without, with filter][misses, hits] */
+    clock_t t;
+    int f, c, r;
+
+    rewind_dict();
+    if ((text = (unsigned char *) malloc(size)) == NULL)
+        error("Not enough memory.");
+    while (n < TUNE_QUERIES && read_string(temp_str))
+    {
+        len = strlen((char *) temp_str) + 1;
+        if (used + len > size
+            && (text = (unsigned char *) realloc(text, size *= 2)) == NULL)
+            error("Not enough memory.");
+        memcpy(text + used, temp_str, len);
+        offset[n] = used;
+        used += len;
+#ifdef USE_VALUES
+        value[n] = str_value;
+#endif
+        n++;
+    }
+    n_strings = strings;
+    n_chars = chars;
+
+    count[0] = count[1] = 0;
+    for (i = 0; i < n; i++)
+    {
+#ifdef USE_VALUES
+        str_value = value[i];
+#endif
+        bloom_filter = NULL;
+        count[(int) (found[i] = (char) check_string(text + offset[i]))]++;
+        bloom_filter = filter;
+        if (!found[i])
+            stopped += !bloom_probe(bloom_hash(text + offset[i]), 0);
     }
-    printf("Size of the automaton: %u bytes\n", aut_size * sizeof automat[0]);
+
+    for (f = 0; f < 2; f++)
+    {
+        bloom_filter = f ? filter : NULL;
+        for (c = 0; c < 2; c++)
+        {
+            t = clock();
+            for (r = 0; r < TUNE_ROUNDS; r++)
+                for (i = 0; i < n; i++)
+                    if (found[i] == c)
+                    {
+#ifdef USE_VALUES
+                        str_value = value[i];
+#endif
+                        check_string(text + offset[i]);
+                    }
+            time[f][c] = (double) (clock() - t) / CLOCKS_PER_SEC;
+        }
+    }
+    bloom_filter = filter;
+
+    printf("Filter: %lu of %lu misses stopped\t%.2f%% false positives\n",
+           stopped, count[0],
+           count[0] ? 100.0 * (count[0] - stopped) / count[0] : 0.0);
+    for (c = 0; c < 2; c++)
+        if (count[c] && time[0][c] != 0.0 && time[1][c] != 0.0)
+            printf("%s: %.lf lookups/s without the filter, %.lf with it\n",
+                   c ? "Hits" : "Misses", count[c] * TUNE_ROUNDS / time[0][c],
+                   count[c] * TUNE_ROUNDS / time[1][c]);
+    free(text);
 }
+#endif
 
 /*
-** Read an automaton from a file fname.
+** Save the automaton to a file of given name. With -j it is followed
+** by a jump table (and its outputs) and the number of its entries,
+** and with -n by a filter, its number of probes and of words.
 */
-void read_automat(char *fname)
+void save_automat(char *fname)
 {
-    if ((aut_file = fopen(fname, "rb")) == NULL)
-        error("Cannot open input file.");
+    unsigned entries;
+
+    if ((aut_file = fopen(fname, "wb")) == NULL)
+        error("Cannot open output file.");
+
+    if (new_jump_depth || new_bloom_bits)
+    {
+        if (aut_layout != LAYOUT)
+            error("A jump table or filter needs the layout of states built.");
+        if (new_jump_depth)
+            make_jump_table();
+        if (new_bloom_bits)
+            make_bloom_filter();
+    }
 
-    aut_size = fread(automat, sizeof automat[0], MAX_AUT_SIZE, aut_file);
+    /* create a pseudo state pointing to the start state */
+    automat[0].all_fields = start_state
+                            | (unsigned) (new_bloom_bits != 0) << BLOOM_SHIFT
+                            | (unsigned) new_jump_depth << JUMP_SHIFT
+                            | aut_layout << LAYOUT_SHIFT;
+    if (fwrite(automat, sizeof automat[0], aut_size, aut_file) < aut_size)
+        error("Error writing to file.");
+#ifdef USE_VALUES
+    if (fwrite(automat_value, sizeof automat_value[0], aut_size, aut_file)
+        < aut_size)
+        error("Error writing to file.");
+#endif
+#ifdef USE_UTF8
+    if (fwrite(alphabet, sizeof alphabet[0], MAX_CHARS, aut_file) < MAX_CHARS)
+        error("Error writing to file.");
+#endif
+    if (new_jump_depth)
+    {
+        entries = (unsigned) jump_size;
+        if (fwrite(jump_table, sizeof jump_table[0], jump_size, aut_file)
+            < jump_size
+#ifdef USE_VALUES
+            || fwrite(jump_value, sizeof jump_value[0], jump_size, aut_file)
+               < jump_size
+#endif
+            || fwrite(&entries, sizeof entries, 1, aut_file) < 1)
+            error("Error writing to file.");
+    }
+    if (new_bloom_bits)
+    {
+        entries = bloom_blocks * BLOOM_BLOCK;
+        if (fwrite(bloom_filter, sizeof bloom_filter[0], entries, aut_file)
+            < entries
+            || fwrite(&bloom_probes, sizeof bloom_probes, 1, aut_file) < 1
+            || fwrite(&entries, sizeof entries, 1, aut_file) < 1)
+            error("Error writing to file.");
+    }
     fclose(aut_file);
-    if (aut_size >= 2)
+}
+
+/*
+** Compare two transitions as unsigned words (for qsort and bsearch).
+*/
+int compare_words(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+** Choose up to PACK_WORDS transitions that occur most often
+** in the automaton: mostly those leading to the few states
+** that end many strings. pack_trans codes them in one byte.
+*/
+void make_pack_dict(void)
+{
+    unsigned *words, count[PACK_WORDS];
+    unsigned i, j, run;
+
+    if ((words = (unsigned *) malloc(aut_size * sizeof *words)) == NULL)
+        error("Not enough memory.");
+    memcpy(words, automat, aut_size * sizeof *words);
+    qsort(words, aut_size, sizeof *words, compare_words);
+
+    /* keep the longest runs of equal words sorted by length */
+    pack_dict_size = 0;
+    for (i = 0; i < aut_size; i += run)
+    {
+        for (run = 1; i + run < aut_size && words[i + run] == words[i]; run++)
+            ;
+        if (run < 2
+            || (pack_dict_size == PACK_WORDS && run <= count[PACK_WORDS - 1]))
+            continue;
+        j = pack_dict_size < PACK_WORDS ? pack_dict_size++ : PACK_WORDS - 1;
+        for (; j > 0 && count[j - 1] < run; j--)
+        {
+            count[j] = count[j - 1];
+            pack_dict[j] = pack_dict[j - 1];
+        }
+        count[j] = run;
+        pack_dict[j] = words[i];
+    }
+    free(words);
+    qsort(pack_dict, pack_dict_size, sizeof pack_dict[0], compare_words);
+}
+
+/*
+** Code the transition at p into out and return the number of bytes
+** used (at most 6, and 5 more for the output). A transition from
+** pack_dict is its index, a byte below 0x80. Any other starts with
+** a varint of the distance from p to its destination (0 if there is
+** none), the terminal bit and the flags ending the state, whose first
+** byte has the top bit set and 6 bits of the number, followed by the
+** label.
+*/
+size_t pack_trans(unsigned p, unsigned char *out)
+{
+    unsigned w = automat[p].all_fields, dest, v;
+    unsigned *d;
+    size_t n = 0;
+
+    d = (unsigned *) bsearch(&w, pack_dict, pack_dict_size, sizeof w,
+                             compare_words);
+    if (d != NULL)
+        out[n++] = (unsigned char) (d - pack_dict);
+    else
     {
-        /* create a pseudo state pointing to the start state */
-        memcpy(&start_state, &automat[0], sizeof automat[0]);
-        automat[0].b.dest = automat[0].all_fields;
-        if (start_state < aut_size)
-            return;
+        dest = (w & ~RAW_LABEL_TERM) >> PACK_FLAGS;
+        v = dest == 0 ? 0 : dest >= p ? 2 * (dest - p) + 1 : 2 * (p - dest);
+        v = v << (PACK_FLAGS + 1) | RAW_TERM(w) << PACK_FLAGS
+            | (w & ((1u << PACK_FLAGS) - 1));
+        out[n++] = (unsigned char) (0x80 | (v > 0x3f) << 6 | (v & 0x3f));
+        for (v >>= 6; v; v >>= 7)
+            out[n++] = (unsigned char) ((v > 0x7f) << 7 | (v & 0x7f));
+        out[n++] = (unsigned char) RAW_LABEL(w);
     }
-    error("Error in input file.");
+#ifdef USE_VALUES
+    for (v = automat_value[p]; v > 0x7f; v >>= 7)
+        out[n++] = (unsigned char) (0x80 | (v & 0x7f));
+    out[n++] = (unsigned char) v;
+#endif
+    return n;
 }
 
 /*
-** Save the automaton to a file of given name.
+** Save the automaton to fname packed in blocks of PACK_BLOCK
+** transitions, each of which can be unpacked alone. The file holds
+** the first word of an automaton file, the number of transitions,
+** of frequent transitions and of blocks, the frequent transitions,
+** the offset of each block in the packed data and its end, the data
+** and, with USE_UTF8, the alphabet. A jump table or filter of the
+** automaton is not kept.
 */
-void save_automat(char *fname)
+void pack_automat(char *fname)
 {
+    unsigned header[4];
+    unsigned p;
+    size_t size = 0, len = 0;
+
+    make_pack_dict();
+    pack_blocks = (aut_size + PACK_BLOCK - 1) / PACK_BLOCK;
+    if ((pack_index = (unsigned *) malloc((pack_blocks + 1)
+                                          * sizeof *pack_index)) == NULL)
+        error("Not enough memory.");
+    for (p = 0; p < aut_size; p++)
+    {
+        if (p % PACK_BLOCK == 0)
+            pack_index[p / PACK_BLOCK] = (unsigned) len;
+        if (len + 16 > size
+            && (pack_data = (unsigned char *) realloc(pack_data,
+                                                      size = 2 * size + 4096))
+            == NULL)
+            error("Not enough memory.");
+        len += pack_trans(p, pack_data + len);
+    }
+    pack_index[pack_blocks] = (unsigned) len;
+
     if ((aut_file = fopen(fname, "wb")) == NULL)
         error("Cannot open output file.");
-
-    /* create a pseudo state pointing to the start state */
-    automat[0].all_fields = start_state;
-    if (fwrite(automat, sizeof automat[0], aut_size, aut_file) < aut_size)
+    header[0] = start_state | (unsigned) LAYOUT << LAYOUT_SHIFT;
+    header[1] = aut_size;
+    header[2] = pack_dict_size;
+    header[3] = pack_blocks;
+    if (fwrite(header, sizeof header[0], 4, aut_file) < 4
+        || fwrite(pack_dict, sizeof pack_dict[0], pack_dict_size, aut_file)
+           < pack_dict_size
+        || fwrite(pack_index, sizeof pack_index[0], pack_blocks + 1, aut_file)
+           < pack_blocks + 1
+        || fwrite(pack_data, 1, len, aut_file) < len
+#ifdef USE_UTF8
+        || fwrite(alphabet, sizeof alphabet[0], MAX_CHARS, aut_file)
+           < MAX_CHARS
+#endif
+        )
         error("Error writing to file.");
     fclose(aut_file);
 }
 
 /*
-** Open the lexicon file.
+** Read an automaton packed by pack_automat from fname. Only the packed
+** blocks stay in memory; use_block unpacks them when needed.
+*/
+void read_packed(char *fname)
+{
+    unsigned header[4];
+    unsigned b;
+#ifdef USE_UTF8
+    unsigned codes[MAX_CHARS];
+#endif
+
+    if ((aut_file = fopen(fname, "rb")) == NULL)
+        error("Cannot open input file.");
+    if (fread(header, sizeof header[0], 4, aut_file) < 4)
+        error("Error in input file.");
+    if (header[0] >> LAYOUT_SHIFT != LAYOUT)
+        error("The automaton file has another layout of states.");
+    if (header[1] < 1 || header[1] > MAX_AUT_SIZE || header[2] > PACK_WORDS
+        || header[3] != (header[1] + PACK_BLOCK - 1) / PACK_BLOCK)
+        error("Error in input file.");
+    start_state = header[0] & ((1u << LAYOUT_SHIFT) - 1);
+    aut_size = header[1];
+    pack_dict_size = header[2];
+    pack_blocks = header[3];
+
+    if ((pack_index = (unsigned *) malloc((pack_blocks + 1)
+                                          * sizeof *pack_index)) == NULL
+        || (pack_slot = (unsigned *) calloc(pack_blocks, sizeof *pack_slot))
+           == NULL)
+        error("Not enough memory.");
+    if (fread(pack_dict, sizeof pack_dict[0], pack_dict_size, aut_file)
+        < pack_dict_size
+        || fread(pack_index, sizeof pack_index[0], pack_blocks + 1, aut_file)
+           < pack_blocks + 1
+        || pack_index[0] != 0)
+        error("Error in input file.");
+    for (b = 0; b < pack_blocks; b++)
+        if (pack_index[b + 1] <= pack_index[b])
+            error("Error in input file.");
+    if ((pack_data = (unsigned char *) malloc(pack_index[pack_blocks]))
+        == NULL)
+        error("Not enough memory.");
+    if (fread(pack_data, 1, pack_index[pack_blocks], aut_file)
+        < pack_index[pack_blocks]
+#ifdef USE_UTF8
+        || fread(codes, sizeof codes[0], MAX_CHARS, aut_file) < MAX_CHARS
+#endif
+        )
+        error("Error in input file.");
+    fclose(aut_file);
+#ifdef USE_UTF8
+    use_alphabet(codes);
+#endif
+    if (start_state >= aut_size)
+        error("Error in input file.");
+}
+
+/*
+** Unpack block b of a packed automaton into the cache slot
+** (see pack_trans).
+*/
+void unpack_block(unsigned b, unsigned slot)
+{
+    unsigned char *s = pack_data + pack_index[b];
+    unsigned *words = pack_cache[slot];
+    unsigned p = b * PACK_BLOCK, end = p + PACK_BLOCK;
+    unsigned c, v, shift;
+#ifdef USE_VALUES
+    unsigned *values = pack_cache_value[slot];
+#endif
+
+    if (end > aut_size)
+        end = aut_size;
+    for (; p < end; p++)
+    {
+        if ((c = *s++) < 0x80)
+            *words++ = pack_dict[c];
+        else
+        {
+            v = c & 0x3f;
+            shift = 6;
+            if (c & 0x40)
+                do
+                {
+                    c = *s++;
+                    v |= (c & 0x7f) << shift;
+                    shift += 7;
+                } while (c & 0x80);
+            c = v >> (PACK_FLAGS + 1);      /* distance to the destination */
+            *words++ = (unsigned) *s++ << 23 | (v >> PACK_FLAGS & 1) << 31
+                       | (c == 0 ? 0 : c & 1 ? p + (c >> 1) : p - (c >> 1))
+                         << PACK_FLAGS
+                       | (v & ((1u << PACK_FLAGS) - 1));
+        }
+#ifdef USE_VALUES
+        v = 0;
+        shift = 0;
+        do
+        {
+            c = *s++;
+            v |= (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        *values++ = v;
+#endif
+    }
+}
+
+/*
+** Make block b the one used by check_packed, unpacking it into
+** the slot of the cache used least recently unless it is there.
+*/
+void use_block(unsigned b)
+{
+    unsigned slot, i;
+
+    if (b >= pack_blocks)
+        error("Error in automaton file.");
+    if (pack_slot[b] != 0)
+    {
+        slot = pack_slot[b] - 1;
+        pack_hits++;
+    }
+    else
+    {
+        slot = 0;
+        for (i = 1; i < PACK_CACHE; i++)
+            if (pack_used[i] < pack_used[slot])
+                slot = i;
+        if (pack_owner[slot] != 0)
+            pack_slot[pack_owner[slot] - 1] = 0;
+        unpack_block(b, slot);
+        pack_owner[slot] = b + 1;
+        pack_slot[b] = slot + 1;
+        pack_misses++;
+    }
+    pack_used[slot] = ++pack_clock;
+    pack_last = b;
+    pack_words = pack_cache[slot];
+#ifdef USE_VALUES
+    pack_values = pack_cache_value[slot];
+#endif
+}
+
+/*
+** Check if the given string exists in the packed automaton,
+** going through check_string's steps on the unpacked blocks.
+** Consecutive transitions mostly share the block used last,
+** which needs no search of the cache.
+*/
+int check_packed(unsigned char *str)
+{
+    transition t;
+    unsigned pos, w;
+#ifdef USE_TREE
+    unsigned k;
+#endif
+#ifdef USE_VALUES
+    unsigned value = 0;
+#endif
+
+    if (pack_last != 0)
+        use_block(0);
+    t.all_fields = pack_words[0];   /* the pseudo state */
+    while (*str)
+    {
+        if ((pos = t.b.dest) == 0)
+            return 0;
+        if (pos >= aut_size)
+            error("Error in automaton file.");
+        w = NEXT_SYMBOL(str);
+
+#ifdef USE_TREE
+        /* descend the tree as find_in_tree_loop does */
+        for (k = 1; ; k = 2 * k + (t.b.attr < w))
+        {
+            if ((pos + k - 1) / PACK_BLOCK != pack_last)
+                use_block((pos + k - 1) / PACK_BLOCK);
+            t.all_fields = pack_words[(pos + k - 1) % PACK_BLOCK];
+            if (t.b.attr == w)
+                break;
+            if (t.b.attr > w ? t.b.llast : t.b.rlast)
+                return 0;
+        }
+#else
+        while (1)
+        {
+            if (pos / PACK_BLOCK != pack_last)
+                use_block(pos / PACK_BLOCK);
+            t.all_fields = pack_words[pos % PACK_BLOCK];
+            if (t.b.attr == w)
+                break;
+            if (t.b.last || ++pos >= aut_size)
+                return 0;
+        }
+#ifdef USE_VALUES
+        value += pack_values[pos % PACK_BLOCK];
+#endif
+#endif
+    }
+#ifdef USE_VALUES
+    return t.b.term && value == str_value;
+#else
+    return t.b.term;
+#endif
+}
+
+/*
+** Open the lexicon file. A compressed file, recognized by its magic
+** bytes when read from a regular file or else by its extension, is
+** opened through a pipe to the compressor, which then runs in parallel
+** with us.
 */
 void open_dict(char *fname, char *attr)
 {
-    if ((lex_file = fopen(fname, attr)) == NULL)
+    char magic[8];
+    size_t len, i;
+    codec *c = NULL;
+
+    dict_command = NULL;
+    coded_len = 0;
+    dict_input = *attr == 'r';
+    if ((lex_file = fopen(fname, front_coded ? (dict_input ? "rb" : "wb")
+                                             : attr)) == NULL)
         error("Cannot open lexicon file.");
+    if (dict_input && regular_file(lex_file))
+    {
+        /* a pipe cannot give back the bytes read */
+        len = fread(magic, 1, sizeof magic, lex_file);
+        for (i = 0; i < N_CODECS; i++)
+            if (len >= codecs[i].magic_len
+                && !memcmp(magic, codecs[i].magic, codecs[i].magic_len))
+                c = &codecs[i];
+        if (c != NULL)
+            dict_command = pipe_command(c->unpack, " < ", fname);
+        else
+            rewind(lex_file);
+    }
+    else
+    {
+        len = strlen(fname);
+        for (i = 0; i < N_CODECS; i++)
+            if (len > strlen(codecs[i].ext)
+                && !strcmp(fname + len - strlen(codecs[i].ext), codecs[i].ext))
+                c = &codecs[i];
+        if (c != NULL)
+            dict_command = pipe_command(dict_input ? c->unpack : c->pack,
+                                        dict_input ? " < " : " > ", fname);
+    }
+
+    if (dict_command != NULL)
+    {
+        fclose(lex_file);
+        if ((lex_file = popen(dict_command, attr)) == NULL)
+            error("Cannot open lexicon file.");
+    }
+    set_io_buffer(lex_file, 8192);
+}
+
+/*
+** Return a new shell command: command, redirect, then fname quoted.
+*/
+char *pipe_command(char *command, char *redirect, char *fname)
+{
+    char *cmd, *p;
+
+    if ((cmd = (char *) malloc(strlen(command) + strlen(redirect)
+                               + 4 * strlen(fname) + 3)) == NULL)
+        error("Not enough memory.");
+    p = cmd + sprintf(cmd, "%s%s", command, redirect);
+#ifdef _WIN32
+    *p++ = '"';
+    while (*fname)
+        *p++ = *fname++;
+    *p++ = '"';
+#else
+    *p++ = '\'';
+    for (; *fname; *p++ = *fname++)
+        if (*fname == '\'')
+        {
+            memcpy(p, "'\\'", 3);   /* close, escape and reopen quotes */
+            p += 3;
+        }
+    *p++ = '\'';
+#endif
+    *p = '\0';
+    return cmd;
+}
+
+/*
+** Start reading the lexicon file again.
+*/
+void rewind_dict(void)
+{
+    coded_len = 0;
+    if (dict_command == NULL)
+    {
+        rewind(lex_file);
+        return;
+    }
+    while (getc(lex_file) != EOF)
+        ;
+    if (pclose(lex_file) != 0
+        || (lex_file = popen(dict_command, "r")) == NULL)
+        error("Cannot decompress lexicon file.");
     set_io_buffer(lex_file, 8192);
 }
 
+/*
+** Close the lexicon file, waiting for the compressor if there is one.
+*/
+void close_dict(void)
+{
+    if (dict_command == NULL)
+    {
+        fclose(lex_file);
+        return;
+    }
+    if (dict_input)
+        while (getc(lex_file) != EOF)   /* let the decompressor finish */
+            ;
+    if (pclose(lex_file) != 0)
+        error("Cannot compress or decompress lexicon file.");
+    free(dict_command);
+    dict_command = NULL;
+}
+
 /*
 ** Print usage info.
 */
 void show_info(void)
 {
     printf("Usage: am -m automaton_file lexicon_file -- make an automaton\n"
+           "       am -m automaton_file lexicon_file speed|size [query_file]\n"
+           "          -- the same in the layout of states best for lookups"
+           " or size\n"
+           "       am -b automaton_file lexicon_file -- the same"
+           " reading in another thread\n"
+           "       am -r automaton_file lexicon_file -- make an automaton"
+           " from an unsorted lexicon\n"
+           "       am -x automaton_file lexicon_file -- the same"
+           " using temporary files\n"
+           "       am -a automaton_file lexicon_file -- append strings"
+           " to an automaton\n"
+           "       am -e automaton_file edit_file -- add (+) and remove (-)"
+           " strings\n"
            "       am -l automaton_file lexicon_file -- list an automaton\n"
+           "       am -p automaton_file lexicon_file -- list an automaton"
+           " in parallel\n"
            "       am -t automaton_file lexicon_file -- test an automaton\n"
+           "       am -h automaton_file lexicon_file -- test an automaton"
+           " while reloading it\n"
+           "       am -z packed_file automaton_file -- pack an automaton"
+           " in blocks\n"
+           "       am -y packed_file lexicon_file -- test a packed automaton"
+           " unpacking\n          blocks on demand\n"
+           "       am -c automaton_file lexicon_file [fold_file]\n"
+           "          -- test an automaton ignoring case and diacritics\n"
+           "       am -u automaton_file automaton_a automaton_b -- union\n"
+           "       am -i automaton_file automaton_a automaton_b -- intersection\n"
+           "       am -s automaton_file automaton_a automaton_b -- difference\n"
+           "       am -w automaton_file command_file result_file\n"
+           "          -- add (+s), remove (-s) and look up (?s) strings;"
+           " every 65536 changes\n          are merged by rebuilding"
+           " the whole automaton in the background\n"
+           "       am -d lexicon_file old_automaton new_automaton\n"
+           "          -- list strings removed (-) and added (+)\n"
+           "       am -k -- time the search in tree-shaped states (USE_TREE)\n"
+           "       am -f -m|-t|-c|-l ... -- the same with a front-coded"
+           " lexicon_file\n"
+           "       am -j1|-j2|-j3 [-f] -m|-b|-r|-x|-a|-e|-u|-i|-s ..."
+           " -- the same saving\n          a jump table"
+           " for the first 1 to 3 symbols of strings\n"
+           "       am -n[bits] ... -- the same saving a filter that rejects"
+           " most absent\n          strings at 10 (or given) bits"
+           " per string\n"
+#ifdef USE_VALUES
+           "\nLexicon lines may end with a tab and an unsigned value."
+           " A repeated string\nkeeps the value of its first line.\n"
+#endif
+           "\nLexicon files compressed with gzip, zstd, xz or bzip2"
+           " (.gz, .zst, .xz, .bz2)\nare passed through these programs.\n"
            "\nPress any key to exit...\n");
     fgetc(stdin);
     exit(EXIT_SUCCESS);
@@ -888,7 +5989,95 @@ int main(int argc, char **argv)
 {
     clock_t t1, t2;
 
-    if (argc == 4)
+    while (argc > 2 && (!strncmp(argv[1], "-j", 2)
+                        || !strncmp(argv[1], "-n", 2)))
+    {
+        if (argv[1][1] == 'j')
+        { /* save a jump table */
+            new_jump_depth = atoi(argv[1] + 2);
+            if (new_jump_depth < 1 || new_jump_depth > MAX_JUMP_DEPTH)
+                error("A jump table can have 1 to 3 levels.");
+        }
+        else
+        { /* save a filter of the strings */
+            new_bloom_bits = argv[1][2] ? atoi(argv[1] + 2) : BLOOM_BITS;
+            if (new_bloom_bits < 1 || new_bloom_bits > 32)
+                error("A filter can have 1 to 32 bits per string.");
+        }
+        argc--;
+        argv++;
+    }
+    if (argc > 2 && !strcmp(argv[1], "-f"))
+    { /* front-coded lexicon */
+        front_coded = 1;
+        argc--;
+        argv++;
+        if (strcmp(argv[1], "-m") && strcmp(argv[1], "-t")
+            && strcmp(argv[1], "-c") && strcmp(argv[1], "-l"))
+            error("Front coding works with -m, -t, -c and -l only.");
+    }
+    if (argc == 5 && (!strcmp(argv[1], "-u") || !strcmp(argv[1], "-i")
+                      || !strcmp(argv[1], "-s")))
+    { /* set operation on two automata */
+        t1 = clock();
+        combine_automata(argv[1][1], argv[3], argv[4]);
+        save_automat(argv[2]);
+        t2 = clock();
+        show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
+    }
+    else if (argc == 5 && !strcmp(argv[1], "-w"))
+    { /* commands on a tiered automaton */
+        open_dict(argv[3], "r");
+        t1 = clock();
+#ifdef USE_VALUES
+        error("Cannot run commands on an automaton with values.");
+#else
+        tiered_automat(argv[2], argv[4]);
+#endif
+        close_dict();
+        t2 = clock();
+        show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
+    }
+    else if (argc == 5 && !strcmp(argv[1], "-d"))
+    { /* differences between two automata */
+        open_dict(argv[2], "w");
+        t1 = clock();
+        diff_automata(argv[3], argv[4]);
+        close_dict();
+        t2 = clock();
+        show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
+    }
+    else if (argc == 2 && !strcmp(argv[1], "-k"))
+    { /* time the search in tree-shaped states */
+#ifdef USE_TREE
+        bench_tree_search();
+#else
+        error("States are trees only with USE_TREE.");
+#endif
+    }
+    else if ((argc == 5 || argc == 6) && !strcmp(argv[1], "-m"))
+    { /* make an automaton in the layout best for an objective */
+        open_dict(argv[3], "r");
+        t1 = clock();
+#ifdef USE_VALUES
+        error("Values need the flat layout of states.");
+#else
+        tune_automat(argv[4], argc == 6 ? argv[5] : NULL);
+        save_automat(argv[2]);
+#endif
+        close_dict();
+        t2 = clock();
+        show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
+    }
+    else if (argc == 4 && !strcmp(argv[1], "-z"))
+    { /* pack an automaton in blocks unpacked on demand */
+        t1 = clock();
+        read_automat(argv[3]);
+        pack_automat(argv[2]);
+        t2 = clock();
+        show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
+    }
+    else if (argc == 4 || (argc == 5 && !strcmp(argv[1], "-c")))
     {
         if (!strcmp(argv[1], "-m"))
         { /* make a new automaton */
@@ -897,27 +6086,106 @@ int main(int argc, char **argv)
             make_automat();
             save_automat(argv[2]);
         }
+        else if (!strcmp(argv[1], "-e"))
+        { /* add and remove strings in any order */
+            open_dict(argv[3], "r");
+            t1 = clock();
+#if defined USE_INCLUSION || defined USE_VALUES
+            error("Cannot edit an automaton with included states or values.");
+#else
+            edit_automat(argv[2]);
+            save_automat(argv[2]);
+#endif
+        }
+        else if (!strcmp(argv[1], "-r"))
+        { /* make a new automaton from an unsorted lexicon */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            make_automat_unsorted();
+            save_automat(argv[2]);
+        }
+        else if (!strcmp(argv[1], "-b"))
+        { /* make a new automaton reading the lexicon in another thread */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            make_automat_pipelined();
+            save_automat(argv[2]);
+        }
+        else if (!strcmp(argv[1], "-x"))
+        { /* make a new automaton from a lexicon larger than memory */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            make_automat_external();
+            save_automat(argv[2]);
+        }
+        else if (!strcmp(argv[1], "-a"))
+        { /* add strings at the end of an automaton */
+            open_dict(argv[3], "r");
+            t1 = clock();
+#ifdef USE_INCLUSION
+            error("Cannot append to an automaton with included states.");
+#else
+            append_automat(argv[2]);
+            save_automat(argv[2]);
+#endif
+        }
         else if (!strcmp(argv[1], "-t"))
         { /* check automaton */
             open_dict(argv[3], "r");
             t1 = clock();
             read_automat(argv[2]);
-            test_automat();
+            test_automat(check_string);
+        }
+        else if (!strcmp(argv[1], "-y"))
+        { /* check a packed automaton */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            read_packed(argv[2]);
+            test_automat(check_packed);
+        }
+        else if (!strcmp(argv[1], "-h"))
+        { /* check automaton while reloading it */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            reload_test(argv[2]);
+        }
+        else if (!strcmp(argv[1], "-c"))
+        { /* check automaton up to case and diacritics */
+            open_dict(argv[3], "r");
+            t1 = clock();
+            read_automat(argv[2]);
+            /* with USE_UTF8 the table needs the alphabet */
+            if (argc == 5)
+                read_fold_table(argv[4]);
+            else
+                prepare_fold_table();
+            test_automat(check_string_fold);
         }
         else if (!strcmp(argv[1], "-l"))
         { /* list strings */
             open_dict(argv[3], "w");
             t1 = clock();
             read_automat(argv[2]);
-#ifdef USE_TREE
-            list_strings(start_state, 0, 0);
-#else
-            list_strings(start_state, 0);
-#endif
+            list_automat();
+        }
+        else if (!strcmp(argv[1], "-p"))
+        { /* list strings using all processors */
+            open_dict(argv[3], "w");
+            t1 = clock();
+            read_automat(argv[2]);
+            list_automat_parallel();
         }
         else
             show_info();
-        fclose(lex_file);
+#ifdef PRINT_STATISTICS
+        if (bloom_filter != NULL && !strcmp(argv[1], "-t"))
+        { /* replay the lookups, timed apart from the test */
+            t2 = clock();
+            bloom_stat();
+            t1 += clock() - t2;
+        }
+#endif
+        close_dict();
         t2 = clock();
         show_stat((double) (t2 - t1) / CLOCKS_PER_SEC);
     }
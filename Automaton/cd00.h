@@ -15,3 +15,90 @@
 #include <string.h>
 #include <time.h>
 #include "targetver.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define PRINT_STATISTICS
+/*#define USE_TREE          /* represent states in complete binary trees */
+/*#define USE_INCLUSION     /* enable including states */
+/*#define USE_UTF8          /* build over UTF-8 code points */
+/*#define USE_VALUES        /* attach a value to each string */
+
+#if defined(USE_VALUES) && (defined(USE_TREE) || defined(USE_INCLUSION))
+#error USE_VALUES requires the flat layout of states
+#endif
+
+/*
+** Layout of states, kept in the bits of the first word of an automaton
+** file above the start state. Files without it have the built layout.
+*/
+#define LAYOUT_SHIFT        28
+#define LAYOUT_FLAT         1
+#define LAYOUT_TREE         2
+#define LAYOUT_INCLUSION    3
+#if defined USE_TREE
+#define LAYOUT              LAYOUT_TREE
+#elif defined USE_INCLUSION
+#define LAYOUT              LAYOUT_INCLUSION
+#else
+#define LAYOUT              LAYOUT_FLAT
+#endif
+
+/*
+** Depth of the jump table saved after the automaton (1 to
+** MAX_JUMP_DEPTH, 0 if there is none), kept in the first word
+** of the file below the layout, and the bit telling that a filter
+** of the strings follows.
+*/
+#define JUMP_SHIFT          26
+#define MAX_JUMP_DEPTH      3
+#define BLOOM_SHIFT         25
+#define BLOOM_BLOCK         16          /* words in a block of the filter */
+#define BLOOM_BASIS         2166136261u /* FNV-1a hash of its strings */
+#define BLOOM_PRIME         16777619u
+
+#define MAX_STR_LEN         300
+#define MAX_CHARS           256
+#define MAX_CODE_POINT      0x110000
+#ifndef USE_TREE
+#define MAX_AUT_SIZE        (1 << 22)
+#else
+#define MAX_AUT_SIZE        (1 << 21)
+#endif
+
+typedef union
+{
+    unsigned all_fields;
+    struct
+    {
+#ifdef USE_TREE
+        unsigned llast : 1;
+        unsigned rlast : 1;
+        unsigned dest : 21;
+#else
+        unsigned last : 1;
+        unsigned dest : 22;
+#endif
+        unsigned attr : 8;
+        unsigned term : 1;
+    } b;
+#ifdef USE_INCLUSION
+    struct
+    {
+        unsigned last : 1;
+        unsigned dest_attr_term : 31;
+    } d;
+#endif
+} transition;
+
+typedef int sizeof_unsigned_int_must_match_sizeof_transition
+[2 * (sizeof(unsigned) == sizeof(transition)) - 1];